@@ -64,8 +64,6 @@ flags = [
 '-I',
 '.',
 '-I',
-'./libmidi/',
-'-I',
 '/usr/local/include',
 '-I',
 '/usr/local/include/FL/images'
@@ -0,0 +1,70 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <cstdint>
+#include "Arena.h"
+
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (64 * 1024 * 1024)
+
+Arena::Arena() : last_block_size(0), pos(nullptr), end(nullptr), total(0)
+{}
+
+Arena::~Arena()
+{
+    for (auto block : blocks) {
+        delete[] block;
+    }
+}
+
+void* Arena::allocate(size_t bytes, size_t align)
+{
+    uintptr_t p = (reinterpret_cast<uintptr_t>(pos) + align - 1) & ~(uintptr_t)(align - 1);
+    if (!pos || p + bytes > reinterpret_cast<uintptr_t>(end)) {
+        newBlock(bytes + align);
+        p = (reinterpret_cast<uintptr_t>(pos) + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    pos = reinterpret_cast<char*>(p + bytes);
+    return reinterpret_cast<void*>(p);
+}
+
+void Arena::reserve(size_t bytes)
+{
+    if (!pos || static_cast<size_t>(end - pos) < bytes) {
+        newBlock(bytes);
+    }
+}
+
+size_t Arena::capacity() const
+{
+    return total;
+}
+
+void Arena::newBlock(size_t min_bytes)
+{
+    //blocks grow geometrically so small tracks stay small and big ones
+    //don't need many blocks
+    size_t size = std::min<size_t>(std::max<size_t>(last_block_size * 2, MIN_BLOCK_SIZE),
+                                   MAX_BLOCK_SIZE);
+    size = std::max(size, min_bytes);
+    char* block = new char[size];
+    blocks.push_back(block);
+    last_block_size = size;
+    total += size;
+    pos = block;
+    end = block + size;
+}
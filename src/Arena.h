@@ -0,0 +1,83 @@
+#ifndef ARENA_H
+#define ARENA_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <vector>
+#include <cstddef>
+#include <new>
+
+//bump allocator, memory is only given back all at once when the arena is
+//destroyed. Not thread safe, give each thread its own arena.
+class Arena {
+public:
+    Arena();
+    ~Arena();
+
+    void* allocate(size_t bytes, size_t align);
+    //makes sure the next allocations totalling up to bytes fit in one block
+    void reserve(size_t bytes);
+    //total size of all blocks
+    size_t capacity() const;
+
+private:
+    Arena(const Arena&);
+    Arena& operator=(const Arena&);
+
+    void newBlock(size_t min_bytes);
+
+    std::vector<char*> blocks;
+    size_t last_block_size;
+    char* pos;
+    char* end;
+    size_t total;
+};
+
+//std allocator drawing from an Arena, deallocation does nothing. Without an
+//arena it falls back to the normal heap.
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+
+    ArenaAllocator(Arena* arena = nullptr) : arena(arena) {}
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n)
+    {
+        if (arena) {
+            return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        if (!arena) {
+            ::operator delete(p);
+        }
+    }
+
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+
+    Arena* arena;
+};
+
+#endif /* ARENA_H */
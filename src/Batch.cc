@@ -0,0 +1,412 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <thread>
+#include "Batch.h"
+#include "MIDI.h"
+#include "MIDILoader.h"
+#include "Renderer.h"
+#include "WorkerPool.h"
+
+//rough bytes per decoded event: the Track columns, the loader's decoding
+//buffers and the arena's slack
+#define LOAD_BYTES_PER_EVENT 64
+//the Renderer's own copy of each event
+#define RENDER_BYTES_PER_EVENT 32
+//the note on/off edges sorted to find the peak polyphony
+#define STATS_BYTES_PER_EVENT 16
+//a MIDI file needs at least about 3 bytes per event (delta, status, data
+//byte with running status), so this bounds the number of events
+#define MIN_BYTES_PER_EVENT 3
+
+static uint64_t fileSize(const std::string& filename)
+{
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file){
+        return 0;
+    }
+    return static_cast<uint64_t>(file.tellg());
+}
+
+static bool hasExtension(const std::string& name, const std::string& ext)
+{
+    if (name.size() < ext.size()){
+        return false;
+    }
+    return std::equal(ext.rbegin(), ext.rend(), name.rbegin(), [](char a, char b){
+        return a == std::tolower(static_cast<unsigned char>(b));
+    });
+}
+
+static bool isSeparator(char c)
+{
+#ifdef _WIN32
+    return c == '/' || c == '\\';
+#else
+    return c == '/';
+#endif
+}
+
+//the .mid files directly inside dir, sorted so runs are repeatable; is_dir
+//is cleared if dir isn't a directory
+static std::vector<std::string> listDirectory(const std::string& dir, bool& is_dir)
+{
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE handle = FindFirstFileA((dir + "\\*").c_str(), &found);
+    if (handle == INVALID_HANDLE_VALUE){
+        is_dir = false;
+        return names;
+    }
+    is_dir = true;
+    do {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)){
+            names.push_back(found.cFileName);
+        }
+    } while (FindNextFileA(handle, &found));
+    FindClose(handle);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d){
+        is_dir = false;
+        return names;
+    }
+    is_dir = true;
+    while (dirent* entry = readdir(d)){
+        names.push_back(entry->d_name);
+    }
+    closedir(d);
+#endif
+    std::vector<std::string> paths;
+    for (auto& name : names){
+        if (hasExtension(name, ".mid") || hasExtension(name, ".midi")){
+            if (!dir.empty() && isSeparator(dir.back())){
+                paths.push_back(dir + name);
+            } else {
+                paths.push_back(dir + "/" + name);
+            }
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+//largest number of notes sounding at once, across all channels
+static int peakPolyphony(MIDIData& data)
+{
+    //+1 at each note's start, -1 at its end; ends sort before starts at the
+    //same time so back to back notes don't count as overlapping
+    std::vector<std::pair<uint64_t, int>> edges;
+    for (int t = 0; t < data.numTracks(); t++){
+        Track* track = data.getTrack(t);
+        for (int i = 0; i < track->numEvents(); i++){
+            if (track->getKind(i) == EventKind::NoteOn){
+                edges.emplace_back(track->getTime(i), 1);
+                edges.emplace_back(track->getTime(i) + track->getNoteDuration(i), -1);
+            }
+        }
+    }
+    std::sort(edges.begin(), edges.end());
+    int sounding = 0;
+    int peak = 0;
+    for (auto& edge : edges){
+        sounding += edge.second;
+        peak = std::max(peak, sounding);
+    }
+    return peak;
+}
+
+//creates dir and any missing parents; true if it exists afterwards
+static bool makeDirectory(const std::string& dir)
+{
+    for (size_t i = 1; i <= dir.size(); i++){
+        if (i != dir.size() && !isSeparator(dir[i])){
+            continue;
+        }
+        std::string prefix = dir.substr(0, i);
+#ifdef _WIN32
+        if (prefix.back() == ':'){
+            continue;
+        }
+        if (!CreateDirectoryA(prefix.c_str(), nullptr) && GetLastError() != ERROR_ALREADY_EXISTS){
+            return false;
+        }
+#else
+        if (mkdir(prefix.c_str(), 0777) != 0 && errno != EEXIST){
+            return false;
+        }
+#endif
+    }
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesA(dir.c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+    struct stat info;
+    return stat(dir.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+Batch::Batch(Mode mode, size_t memory_budget, unsigned num_jobs)
+    : mode(mode), memory_budget(memory_budget), num_jobs(num_jobs), sf_size(0),
+      memory_reserved(0), peak_reserved(0), running(0), out(nullptr)
+{
+    if (this->num_jobs == 0){
+        this->num_jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+}
+
+void Batch::addPath(std::string path)
+{
+    bool is_dir;
+    std::vector<std::string> paths = listDirectory(path, is_dir);
+    if (!is_dir){
+        paths.push_back(path);
+    }
+    for (auto& p : paths){
+        Job job;
+        job.filename = p;
+        job.estimate = 0;
+        job.ok = false;
+        job.seconds = 0;
+        job.tracks = 0;
+        job.events = 0;
+        job.notes = 0;
+        job.duration = 0;
+        job.polyphony = 0;
+        jobs.push_back(job);
+    }
+}
+
+void Batch::setSoundFont(std::string sf_file)
+{
+    this->sf_file = sf_file;
+    sf_size = fileSize(sf_file);
+}
+
+void Batch::setOutputDir(std::string output_dir)
+{
+    this->output_dir = output_dir;
+}
+
+size_t Batch::estimateMemory(uint64_t file_size) const
+{
+    uint64_t per_event = LOAD_BYTES_PER_EVENT;
+    uint64_t fixed = 0;
+    if (mode == Mode::Render){
+        per_event += RENDER_BYTES_PER_EVENT;
+        fixed += sf_size;
+    } else if (mode == Mode::Stats){
+        per_event += STATS_BYTES_PER_EVENT;
+    }
+    return static_cast<size_t>(fixed + file_size / MIN_BYTES_PER_EVENT * per_event);
+}
+
+void Batch::reserve(size_t bytes)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    memory_freed.wait(lock, [&]{
+        return running == 0 || memory_budget == 0 || memory_reserved + bytes <= memory_budget;
+    });
+    memory_reserved += bytes;
+    peak_reserved = std::max(peak_reserved, memory_reserved);
+    running++;
+}
+
+void Batch::release(size_t bytes)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        memory_reserved -= bytes;
+        running--;
+    }
+    memory_freed.notify_all();
+}
+
+std::string Batch::outputName(const std::string& filename) const
+{
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.size();
+    for (size_t i = filename.size(); i > 0; i--){
+        if (isSeparator(filename[i - 1])){
+            slash = i - 1;
+            break;
+        }
+    }
+    std::string stem = filename;
+    if (dot != std::string::npos && (slash == filename.size() || dot > slash)){
+        stem = filename.substr(0, dot);
+    }
+    if (output_dir.empty()){
+        return stem + ".wav";
+    }
+    if (slash != filename.size()){
+        stem = stem.substr(slash + 1);
+    }
+    if (isSeparator(output_dir.back())){
+        return output_dir + stem + ".wav";
+    }
+    return output_dir + "/" + stem + ".wav";
+}
+
+void Batch::runJob(Job& job)
+{
+    if (!job.message.empty()){
+        //run() already turned it down
+    } else if (memory_budget != 0 && job.estimate > memory_budget){
+        job.message = "needs about " + std::to_string(job.estimate >> 20)
+                      + " MB, more than the memory budget";
+    } else {
+        reserve(job.estimate);
+        auto start = std::chrono::steady_clock::now();
+        try {
+            MIDIData data;
+            MIDILoader(job.filename, &data).load();
+            job.tracks = data.numTracks();
+            for (int t = 0; t < data.numTracks(); t++){
+                Track* track = data.getTrack(t);
+                job.events += track->numEvents();
+                job.duration = std::max(job.duration, track->getDuration());
+                for (int i = 0; i < track->numEvents(); i++){
+                    if (track->getKind(i) == EventKind::NoteOn){
+                        job.notes++;
+                    }
+                }
+            }
+            if (mode == Mode::Render){
+                //the jobs already keep every core busy, so each song gets one synth
+                Renderer renderer(&data, sf_file, num_jobs > 1 ? 1 : 0);
+                renderer.render(outputName(job.filename));
+            } else if (mode == Mode::Stats){
+                job.polyphony = peakPolyphony(data);
+            }
+            job.ok = true;
+        } catch (std::exception& e){
+            job.message = e.what();
+        }
+        job.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        release(job.estimate);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (job.ok){
+        *out << "ok     " << job.filename << ": " << job.tracks << " tracks, "
+             << job.notes << " notes, " << job.duration / 1000000.0 << "s";
+        if (mode == Mode::Stats){
+            *out << ", polyphony " << job.polyphony;
+        }
+        *out << " (" << job.seconds << "s)" << std::endl;
+    } else {
+        *out << "failed " << job.filename << ": " << job.message << std::endl;
+    }
+}
+
+int Batch::run(std::ostream& out)
+{
+    this->out = &out;
+    if (mode == Mode::Render && sf_size == 0){
+        throw BatchError("can't read soundfont " + sf_file);
+    }
+    //checked once here, otherwise every job would fail to open its output
+    if (mode == Mode::Render && !output_dir.empty() && !makeDirectory(output_dir)){
+        throw BatchError("can't create output directory " + output_dir);
+    }
+
+    //files with the same name from different directories, or a.mid and
+    //a.midi, would render over each other, so only the first one is kept
+    std::map<std::string, std::string> outputs;
+    for (auto& job : jobs){
+        if (mode != Mode::Render){
+            break;
+        }
+        std::string output = outputName(job.filename);
+#if defined(_WIN32) || defined(__APPLE__)
+        std::transform(output.begin(), output.end(), output.begin(), [](char c){
+            return static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        });
+#endif
+        auto found = outputs.find(output);
+        if (found != outputs.end()){
+            job.message = "would overwrite " + found->first + " rendered from " + found->second;
+        } else {
+            outputs[output] = job.filename;
+        }
+    }
+
+    std::vector<WorkerPool::Task> tasks;
+    std::vector<size_t> costs;
+    for (auto& job : jobs){
+        job.estimate = estimateMemory(fileSize(job.filename));
+        Job* j = &job;
+        tasks.push_back([this, j]{ runJob(*j); });
+        costs.push_back(job.estimate);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (num_jobs == 1){
+        for (auto& task : tasks){
+            task();
+        }
+    } else {
+        //a pool of its own rather than the shared one, since jobs block
+        //waiting for memory and the loader and renderer use the shared pool
+        //themselves; the calling thread makes up the last job
+        WorkerPool pool(num_jobs - 1);
+        pool.run(tasks, costs);
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int failed = 0;
+    uint64_t events = 0;
+    uint64_t duration = 0;
+    for (auto& job : jobs){
+        if (job.ok){
+            events += job.events;
+            duration += job.duration;
+        } else {
+            failed++;
+        }
+    }
+    out << std::endl << jobs.size() - failed << " of " << jobs.size() << " files ok, "
+        << failed << " failed in " << wall << "s with " << num_jobs << " jobs" << std::endl;
+    out << events << " events (" << static_cast<uint64_t>(events / std::max(wall, 1e-6))
+        << " per second), " << duration / 1000000.0 << "s of music";
+    if (mode == Mode::Render){
+        out << " (" << duration / 1000000.0 / std::max(wall, 1e-6) << "x real time)";
+    }
+    out << std::endl;
+    out << "peak memory reserved " << std::fixed << std::setprecision(1)
+        << peak_reserved / 1048576.0 << " MB";
+    if (memory_budget != 0){
+        out << " of " << memory_budget / 1048576.0 << " MB";
+    }
+    out << std::defaultfloat << std::endl;
+    this->out = nullptr;
+    return failed;
+}
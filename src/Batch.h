@@ -0,0 +1,104 @@
+#ifndef BATCH_H
+#define BATCH_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <ostream>
+#include <cstdint>
+#include <mutex>
+#include <condition_variable>
+
+//loads, renders or gathers statistics on a list of MIDI files, several at
+//a time on a worker pool, without any UI
+class Batch {
+public:
+    enum class Mode {
+        //just load each file, to check they all parse and time it
+        Load,
+        //render each file to a .wav next to it, or in the output directory;
+        //a file whose .wav another one already claimed fails
+        Render,
+        //report tracks, notes, length and peak polyphony of each file
+        Stats
+    };
+
+    //no more than memory_budget bytes are expected to be in use across the
+    //jobs running at once; 0 jobs means one per hardware thread
+    Batch(Mode mode, size_t memory_budget, unsigned num_jobs);
+
+    //adds path, or every .mid file directly inside it if it's a directory
+    void addPath(std::string path);
+    //soundfont for rendering
+    void setSoundFont(std::string sf_file);
+    //where rendered files go, next to the MIDI files if not set; run() creates
+    //it if missing
+    void setOutputDir(std::string output_dir);
+    //runs every job, writing a line to out as each one finishes and a summary
+    //at the end; returns the number of jobs that failed
+    int run(std::ostream& out);
+
+    class BatchError : public std::exception {
+    public:
+        BatchError(std::string error) : error(error) {}
+        virtual const char* what() const noexcept { return error.c_str(); }
+    private:
+        std::string error;
+    };
+
+private:
+    struct Job {
+        std::string filename;
+        //upper bound on the memory the job needs, in bytes
+        size_t estimate;
+        bool ok;
+        std::string message;
+        double seconds;
+        int tracks;
+        uint64_t events;
+        uint64_t notes;
+        uint64_t duration;
+        int polyphony;
+    };
+
+    void runJob(Job& job);
+    //what a job on a file of file_size bytes can need at most
+    size_t estimateMemory(uint64_t file_size) const;
+    //blocks until bytes fit in what's left of the budget, or nothing else
+    //is running
+    void reserve(size_t bytes);
+    void release(size_t bytes);
+    std::string outputName(const std::string& filename) const;
+
+    Mode mode;
+    size_t memory_budget;
+    unsigned num_jobs;
+    std::string sf_file;
+    uint64_t sf_size;
+    std::string output_dir;
+    std::vector<Job> jobs;
+
+    //guards everything below and out while running
+    std::mutex mutex;
+    std::condition_variable memory_freed;
+    size_t memory_reserved;
+    size_t peak_reserved;
+    int running;
+    std::ostream* out;
+};
+
+#endif /* BATCH_H */
@@ -0,0 +1,92 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+#include "Batch.h"
+#include "Synth.h"
+
+//command line tool that runs the player's loading, rendering and analysis
+//over many MIDI files at once, without FLTK
+
+static void usage(const char* name)
+{
+    std::cerr << "usage: " << name << " [options] file.mid|directory...\n"
+              << " --load                only load the files (default)\n"
+              << " --render              render each file to .wav\n"
+              << " --stats               report each file's notes and polyphony\n"
+              << " --out directory       where rendered files go (created if missing), next to\n"
+              << "                       the inputs if not given\n"
+              << " --soundfont file.sf2  soundfont to render with (" << DEFAULT_SF2 << ")\n"
+              << " --jobs n              files to work on at once, one per core if not given\n"
+              << " --memory MB           memory the jobs running at once may use, unlimited if not given"
+              << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    Batch::Mode mode = Batch::Mode::Load;
+    std::string out_dir;
+    std::string sf_file = DEFAULT_SF2;
+    unsigned jobs = 0;
+    size_t memory = 0;
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; i++){
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--load"){
+            mode = Batch::Mode::Load;
+        } else if (arg == "--render"){
+            mode = Batch::Mode::Render;
+        } else if (arg == "--stats"){
+            mode = Batch::Mode::Stats;
+        } else if (arg == "--out" && has_value){
+            out_dir = argv[++i];
+        } else if (arg == "--soundfont" && has_value){
+            sf_file = argv[++i];
+        } else if (arg == "--jobs" && has_value){
+            jobs = std::atoi(argv[++i]);
+        } else if (arg == "--memory" && has_value){
+            memory = static_cast<size_t>(std::atof(argv[++i]) * 1048576);
+        } else if (arg.compare(0, 2, "--") == 0){
+            std::cerr << "error: unknown option: " << arg << std::endl;
+            usage(argv[0]);
+            return 2;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.empty()){
+        usage(argv[0]);
+        return 2;
+    }
+
+    try {
+        Batch batch(mode, memory, jobs);
+        batch.setSoundFont(sf_file);
+        batch.setOutputDir(out_dir);
+        for (auto& path : paths){
+            batch.addPath(path);
+        }
+        return batch.run(std::cout) == 0 ? 0 : 1;
+    } catch (std::exception &e){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,112 @@
+#ifndef INTERVALINDEX_H
+#define INTERVALINDEX_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+//finds the intervals overlapping a range of time among n intervals sorted by
+//start. The sorted order is treated as an implicit balanced tree (the root of
+//[lo, hi) is the middle item), with each node storing the latest end in its
+//subtree, so whole subtrees ending before the range are skipped. The
+//intervals themselves stay with the caller and are read through start(i) and
+//end(i).
+class IntervalIndex {
+public:
+    IntervalIndex() {}
+
+    int size() const { return max_end.size(); }
+    void clear() { max_end.clear(); }
+
+    template <class Start, class End>
+    void build(int n, Start start, End end)
+    {
+        max_end.assign(n, 0);
+        buildRange(0, n, start, end);
+    }
+
+    //call when item pos now ends at end. Ends that get shorter don't need
+    //updating, a too-large max only costs a few extra visits.
+    void extend(int pos, uint64_t end)
+    {
+        int lo = 0, hi = size();
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+            max_end[mid] = std::max(max_end[mid], end);
+            if (pos == mid) {
+                return;
+            } else if (pos < mid) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+    }
+
+    //calls func(i) in start order for every interval overlapping [t0, t1],
+    //stopping early if func returns false
+    template <class Start, class End, class Func>
+    void query(uint64_t t0, uint64_t t1, Start start, End end, Func func) const
+    {
+        queryRange(0, size(), t0, t1, start, end, func);
+    }
+
+private:
+    template <class Start, class End>
+    uint64_t buildRange(int lo, int hi, Start& start, End& end)
+    {
+        if (lo >= hi) {
+            return 0;
+        }
+        int mid = lo + (hi - lo) / 2;
+        uint64_t m = end(mid);
+        m = std::max(m, buildRange(lo, mid, start, end));
+        m = std::max(m, buildRange(mid + 1, hi, start, end));
+        max_end[mid] = m;
+        return m;
+    }
+
+    template <class Start, class End, class Func>
+    bool queryRange(int lo, int hi, uint64_t t0, uint64_t t1,
+                    Start& start, End& end, Func& func) const
+    {
+        if (lo >= hi) {
+            return true;
+        }
+        int mid = lo + (hi - lo) / 2;
+        //nothing in this subtree reaches the range
+        if (max_end[mid] < t0) {
+            return true;
+        }
+        if (!queryRange(lo, mid, t0, t1, start, end, func)) {
+            return false;
+        }
+        //this item and everything after it starts after the range
+        if (start(mid) > t1) {
+            return false;
+        }
+        if (end(mid) >= t0 && !func(mid)) {
+            return false;
+        }
+        return queryRange(mid + 1, hi, t0, t1, start, end, func);
+    }
+
+    std::vector<uint64_t> max_end;
+};
+
+#endif /* INTERVALINDEX_H */
@@ -15,197 +15,183 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <iostream>
-#include <sstream>
-#include <iomanip>
-#include <Fl/fl_draw.H>
+#include <algorithm>
 #include "MIDI.h"
-#include "Viewport.h"
 
-NoteOn::NoteOn(Viewport* view, Track* track, unsigned long time, short channel,
-               short value, short velocity, int duration)
-               : ChannelEvent(view, track, "NoteOn", time, channel),
-                 value(value), velocity(velocity), duration(duration)
+//song time between channel state checkpoints, in us
+#define CHECKPOINT_INTERVAL 1000000
+
+Track::Track(Arena* arena) : arena(arena), times(arena), durations(arena),
+                             kinds(arena), channels(arena), values(arena), velocities(arena),
+                             r(255), g(255), b(255), note_index_dirty(false),
+                             note_summary_dirty(true), checkpoints_dirty(false)
 {}
 
-short NoteOn::getValue() const
+uint64_t Track::getDuration() const
 {
-    return value;
+    if (times.empty()){
+        return 0;
+    } else {
+        return times.back();
+    }
 }
 
-int NoteOn::getDuration() const
+int Track::addEvent(const Event& ev)
 {
-    return duration;
+    //index of first event occurring at the same time or after the event
+    //we are inserting
+    int idx = getEventAt(ev.time);
+    if (idx < 0){
+        idx = numEvents();
+    }
+    insertAt(idx, ev);
+    return idx;
 }
 
-void NoteOn::setDuration(int duration)
+void Track::appendEvent(const Event& ev)
 {
-    this->duration = duration;
+    insertAt(numEvents(), ev);
 }
 
-void NoteOn::run()
+void Track::removeEvent(int index)
 {
-    char r, g, b;
-    track->getColour(r, g, b);
-    view->getPlayback()->getSynth()->noteOn(getChannel(), value, velocity);
-    view->getKeyboard()->setKey(value, true, r, g, b);
-    view->redraw();
+    note_index_dirty = true;
+    checkpoints_dirty = true;
+    times.erase(times.begin() + index);
+    durations.erase(durations.begin() + index);
+    kinds.erase(kinds.begin() + index);
+    channels.erase(channels.begin() + index);
+    values.erase(values.begin() + index);
+    velocities.erase(velocities.begin() + index);
 }
 
-void NoteOn::draw()
+void Track::removeNotesAt(uint64_t time, int value)
 {
-    int x, y;
-    NoteEditor* editor = view->getEditor();
-    int w = duration / editor->getMsPerPixel();
-    int h = editor->getNoteThickness(value);
-
-    editor->getNotePos(value, getTime(), x, y);
-    fl_rectf(x, y + 1, w, h - 1);
-}
-
-NoteOff::NoteOff(Viewport* view, Track* track, unsigned long time, short channel,
-                 short value)
-                 : ChannelEvent(view, track, "NoteOff", time, channel), value(value)
-{}
+    int trk_size = numEvents();
+    int note = -1;
+    int note_off = -1;
 
-short NoteOff::getValue() const
-{
-    return value;
-}
+    //find NoteOn events that are occurring at time on this note
+    forNotesIn(time, time, [&](int idx) {
+        if (values[idx] != value){
+            return true;
+        }
+        //find the associated NoteOff event
+        for (int i = idx; i < trk_size; i++){
+            if (kinds[i] == EventKind::NoteOff && values[i] == value){
+                note = idx;
+                note_off = i;
+                return false;
+            }
+        }
+        return true;
+    });
 
-void NoteOff::run()
-{
-    view->getPlayback()->getSynth()->noteOff(getChannel(), value);
-    view->getKeyboard()->setKey(value, false, 0, 0, 0);
-    view->redraw();
+    if (note >= 0){
+        //remove the later event first so note stays valid
+        removeEvent(note_off);
+        removeEvent(note);
+    }
 }
 
-void NoteOff::draw()
-{}
-
-Track::Track() : r(255), g(255), b(255)
+int Track::numEvents() const
 {
-    //events.reserve();
+    return times.size();
 }
 
-ProgramChange::ProgramChange(Viewport* view, Track* track, unsigned long time,
-                             short channel, short voice)
-                             : ChannelEvent(view, track, "ProgramChange", time, channel), voice(voice)
-{}
-
-short ProgramChange::getVoice() const
+void Track::reserve(int num_events)
 {
-    return voice;
+    if (arena){
+        //one block for all the columns, plus room to align each of them
+        arena->reserve(num_events * (sizeof(uint64_t) + sizeof(uint32_t)
+                                     + sizeof(EventKind) + 3 * sizeof(uint8_t))
+                       + 6 * alignof(uint64_t));
+    }
+    times.reserve(num_events);
+    durations.reserve(num_events);
+    kinds.reserve(num_events);
+    channels.reserve(num_events);
+    values.reserve(num_events);
+    velocities.reserve(num_events);
 }
 
-void ProgramChange::run()
+Event Track::getEvent(int index, const TempoMap& tempo_map) const
 {
-    view->getPlayback()->getSynth()->programChange(getChannel(), voice);
+    return Event(kinds[index], getTick(index, tempo_map), times[index], channels[index], values[index],
+                 velocities[index], durations[index]);
 }
 
-void ProgramChange::draw()
-{}
-
-unsigned long Track::getDuration() const
+int Track::getEventAt(int64_t time) const
 {
-    int n = events.size();
-    if (n == 0){
+    if (time < 0){
         return 0;
-    } else {
-        return events[n - 1]->getTime();
     }
-}
 
-void Track::addEvent(std::shared_ptr<Event> ev)
-{
-    //index of first event occurring at the same time or after the event
-    //we are inserting
-    int idx = getEventAt(ev->getTime());
-    if (idx >= 0){
-        events.insert(events.begin() + idx, ev);
-    } else {
-        events.push_back(ev);
+    //find first event that occurs at or after the given time
+    auto it = std::lower_bound(times.begin(), times.end(),
+                               static_cast<uint64_t>(time));
+    //if no event occurs at or after the given time, return -1
+    if (it == times.end()){
+        return -1;
     }
+    return it - times.begin();
 }
 
-void Track::appendEvent(std::shared_ptr<Event> ev)
-{
-    events.push_back(ev);
-}
-
-void Track::removeEvent(std::shared_ptr<Event> ev)
+void Track::getChannelState(uint64_t time, ChannelState& state) const
 {
-    int size = events.size();
-    for (int i = 0; i < size; i++){
-        if (events[i] == ev){
-            events.erase(events.begin() + i);
-            break;
-        }
+    if (checkpoints_dirty){
+        checkpoints.build(*this);
+        checkpoints_dirty = false;
     }
+    checkpoints.stateAt(*this, time, state);
 }
 
-void Track::removeNotesAt(unsigned long time, int value)
+void Track::setNoteDuration(int index, uint32_t duration)
 {
-    int trk_size = numEvents();
-
-    //find NoteOn events that are occurring at time on this note
-    for (int idx = 0; idx < trk_size; idx++){
-        if (getEvent(idx)->getTime() <= time &&
-                time <= getEvent(idx)->getTime() + getEvent(idx)->getDuration() &&
-                getEvent(idx)->getType() == std::string("NoteOn") &&
-                static_cast<NoteOn*>(getEvent(idx).get())->getValue() == value){
-            //find the associated NoteOff event
-            for (int i = idx; i < trk_size; i++){
-                if (getEvent(i)->getType() == std::string("NoteOff") &&
-                        static_cast<NoteOff*>(getEvent(i).get())->getValue() == value){
-                    removeEvent(getEvent(idx));
-                    removeEvent(getEvent(--i)); //decr. i because we've removed an event,
-                    return;
-                }
-            }
-        }
+    durations[index] = duration;
+    note_summary_dirty = true;
+    //a longer note only needs the latest ends above it raised
+    if (!note_index_dirty && kinds[index] == EventKind::NoteOn){
+        auto it = std::lower_bound(note_events.begin(), note_events.end(), index);
+        note_index.extend(it - note_events.begin(), times[index] + duration);
     }
 }
 
-int Track::numEvents() const
-{
-    return events.size();
-}
-
-std::shared_ptr<Event> Track::getEvent(int index) const
+void Track::insertAt(int index, const Event& ev)
 {
-    return events[index];
+    if (ev.channel < 0 || ev.channel > 15 || ev.value < 0 || ev.value > 127
+        || ev.velocity < 0 || ev.velocity > 127){
+        throw InvalidEvent("Event out of MIDI range: channel " + std::to_string(ev.channel)
+                           + ", value " + std::to_string(ev.value)
+                           + ", velocity " + std::to_string(ev.velocity));
+    }
+    note_index_dirty = true;
+    checkpoints_dirty = true;
+    times.insert(times.begin() + index, ev.time);
+    durations.insert(durations.begin() + index, ev.duration);
+    kinds.insert(kinds.begin() + index, ev.kind);
+    channels.insert(channels.begin() + index, ev.channel);
+    values.insert(values.begin() + index, ev.value);
+    velocities.insert(velocities.begin() + index, ev.velocity);
 }
 
-int Track::getEventAt(long time) const
+void Track::updateNoteIndex() const
 {
-    if (time < 0){
-        return 0;
-    }
-
-    int size = events.size();
-    int i = size / 2;
-    int jump = i / 2;
-    if (jump == 0) { jump = 1; }
-
-    //if no event occurs at or after the given time, return -1
-    if (events.empty() || events[size - 1]->getTime() < time){
-        return -1;
+    if (!note_index_dirty){
+        return;
     }
-
-    //find first event that occurs at or after the given time
-    while (i >= 0 && i <= size - 1 &&
-           !((i == 0 || events[i-1]->getTime() < time)
-             && events[i]->getTime() >= time)){
-        jump /= 2;
-        if (jump == 0) { jump = 1; }
-        if (events[i]->getTime() < time){
-            i += jump;
-        } else {
-            i -= jump;
+    note_events.clear();
+    int num_events = numEvents();
+    for (int i = 0; i < num_events; i++){
+        if (kinds[i] == EventKind::NoteOn){
+            note_events.push_back(i);
         }
     }
-
-    return i;
+    note_index.build(note_events.size(),
+                     [&](int i) { return times[note_events[i]]; },
+                     [&](int i) { return times[note_events[i]] + durations[note_events[i]]; });
+    note_index_dirty = false;
+    note_summary_dirty = true;
 }
 
 void Track::setColour(char r, char g, char b)
@@ -222,104 +208,169 @@ void Track::getColour(char &r, char &g, char &b) const
     b = this->b;
 }
 
-Playback::Playback(Viewport* view) : view(view), time_elapsed(0), playing(false)
-{}
+ChannelState::ChannelState()
+{
+    std::fill(programs, programs + 16, -1);
+    std::fill(program_times, program_times + 16, 0);
+}
 
-unsigned long Playback::getTime() const
+//applies a track's events [begin, end) to programs and held notes
+static void replayEvents(const Track& track, int begin, int end, short* programs,
+                         uint64_t* program_times, std::vector<ChannelState::HeldNote>& held)
 {
-    if (playing){
-        return std::chrono::duration_cast<std::chrono::milliseconds>
-            (std::chrono::steady_clock::now() - start_time).count();
-    } else {
-        return time_elapsed;
+    for (int i = begin; i < end; i++){
+        uint8_t channel = track.getChannel(i);
+        uint8_t value = track.getValue(i);
+        switch (track.getKind(i)){
+        case EventKind::ProgramChange:
+            programs[channel] = value;
+            program_times[channel] = track.getTime(i);
+            break;
+        case EventKind::NoteOn:
+        case EventKind::NoteOff:
+            //a repeated NoteOn restarts the note rather than stacking it
+            for (size_t n = 0; n < held.size(); n++){
+                if (held[n].channel == channel && held[n].key == value){
+                    held.erase(held.begin() + n);
+                    break;
+                }
+            }
+            if (track.getKind(i) == EventKind::NoteOn){
+                ChannelState::HeldNote note = { channel, value,
+                                                static_cast<uint8_t>(track.getVelocity(i)) };
+                held.push_back(note);
+            }
+            break;
+        }
     }
 }
 
-Synth* Playback::getSynth()
+static bool sameNote(const ChannelState::HeldNote& a, const ChannelState::HeldNote& b)
 {
-    return &synth;
+    return a.channel == b.channel && a.key == b.key && a.velocity == b.velocity;
 }
 
-void Playback::seek(unsigned long time)
+void ChannelCheckpoints::build(const Track& track)
 {
-    MIDIData* data = view->getMIDIData();
-    Track* track;
-    int num_tracks = data->numTracks();
+    checkpoints.clear();
+    programs.clear();
+    held_notes.clear();
 
-    time_elapsed = time;
-    updateIndices();
-    for (int i = 0; i < num_tracks; i++){
-        track = data->getTrack(i);
-        track_indices[i] = track->getEventAt(time);
-        if (track_indices[i] == -1){
-            track_indices[i] = track->numEvents(); //the track is over,
-                                                   //set index to last event + 1
+    Checkpoint checkpoint = { 0, -1, 0, 0 };
+    Programs current;
+    std::fill(current.programs, current.programs + 16, -1);
+    std::fill(current.program_times, current.program_times + 16, 0);
+    std::vector<ChannelState::HeldNote> held;
+
+    int num_events = track.numEvents();
+    uint64_t duration = track.getDuration();
+    for (uint64_t time = 0; ; time += CHECKPOINT_INTERVAL){
+        int end = checkpoint.event;
+        bool program_changed = false;
+        while (end < num_events && track.getTime(end) < time){
+            program_changed |= track.getKind(end) == EventKind::ProgramChange;
+            end++;
+        }
+        replayEvents(track, checkpoint.event, end, current.programs,
+                     current.program_times, held);
+        checkpoint.event = end;
+        if (program_changed){
+            checkpoint.programs = programs.size();
+            programs.push_back(current);
+        }
+        //most of a song's seconds end with different notes held, but long
+        //stretches without any, or of sustained chords, are common
+        bool same_notes = held.size() == checkpoint.notes_end - checkpoint.notes_begin &&
+                          std::equal(held.begin(), held.end(),
+                                     held_notes.begin() + checkpoint.notes_begin, sameNote);
+        if (!same_notes){
+            checkpoint.notes_begin = held_notes.size();
+            held_notes.insert(held_notes.end(), held.begin(), held.end());
+            checkpoint.notes_end = held_notes.size();
+        }
+        checkpoints.push_back(checkpoint);
+        if (time > duration){
+            break;
         }
     }
-    view->getKeyboard()->clear();
-    view->redraw();
-    synth.clear();
-
-    if (playing)
-        play();
+    checkpoints.shrink_to_fit();
+    programs.shrink_to_fit();
+    held_notes.shrink_to_fit();
 }
 
-void Playback::pause()
+void ChannelCheckpoints::stateAt(const Track& track, uint64_t time, ChannelState& state) const
 {
-    time_elapsed = std::chrono::duration_cast<std::chrono::milliseconds>
-                 (std::chrono::steady_clock::now() - start_time).count();
-    playing = false;
-}
+    if (checkpoints.empty()){
+        return;
+    }
+    //last checkpoint at or before time
+    size_t idx = std::min<uint64_t>(time / CHECKPOINT_INTERVAL, checkpoints.size() - 1);
+    const Checkpoint& checkpoint = checkpoints[idx];
+
+    short programs[16];
+    uint64_t program_times[16];
+    if (checkpoint.programs >= 0){
+        const Programs& saved = this->programs[checkpoint.programs];
+        std::copy(saved.programs, saved.programs + 16, programs);
+        std::copy(saved.program_times, saved.program_times + 16, program_times);
+    } else {
+        std::fill(programs, programs + 16, -1);
+        std::fill(program_times, program_times + 16, 0);
+    }
+    std::vector<ChannelState::HeldNote> held(held_notes.begin() + checkpoint.notes_begin,
+                                             held_notes.begin() + checkpoint.notes_end);
+    int end = checkpoint.event;
+    int num_events = track.numEvents();
+    while (end < num_events && track.getTime(end) < time){
+        end++;
+    }
+    replayEvents(track, checkpoint.event, end, programs, program_times, held);
 
-void Playback::play()
-{
-    MIDIData* data = view->getMIDIData();
-    std::chrono::milliseconds ms(time_elapsed);
-    start_time = std::chrono::steady_clock::now() - ms;
-    time_elapsed = 0;
-    for (int i = 0; i < data->numTracks(); i++){
-        updateIndices();
+    for (int c = 0; c < 16; c++){
+        if (programs[c] >= 0 && (state.programs[c] < 0 || program_times[c] >= state.program_times[c])){
+            state.programs[c] = programs[c];
+            state.program_times[c] = program_times[c];
+        }
     }
-    playing = true;
+    state.held_notes.insert(state.held_notes.end(), held.begin(), held.end());
 }
 
-void Playback::updateIndices()
+MergedCursor::MergedCursor()
+{}
+
+void MergedCursor::reset(const std::vector<const Track*>& tracks, uint64_t time)
 {
-    int new_tracks = view->getMIDIData()->numTracks() - track_indices.size();
-    for (int i = 0; i < new_tracks; i++){
-        track_indices.push_back(0);
+    this->tracks = tracks;
+    indices.assign(tracks.size(), 0);
+    heap.clear();
+    for (size_t i = 0; i < tracks.size(); i++){
+        int index = tracks[i]->getEventAt(time);
+        if (index < 0){
+            //the track is over
+            indices[i] = tracks[i]->numEvents();
+        } else {
+            indices[i] = index;
+            Entry entry = { tracks[i]->getTime(index), static_cast<int>(i) };
+            heap.push_back(entry);
+        }
     }
+    std::make_heap(heap.begin(), heap.end(), later);
 }
 
-void Playback::everyFrame()
-{
-    MIDIData* data = view->getMIDIData();
-    int num_events;
-    int num_tracks = data->numTracks();
-    Track* track;
-    if (playing){
-        for (int i = 0; i < num_tracks; i++){
-            track = data->getTrack(i);
-            num_events = track->numEvents();
-            while (track_indices[i] < num_events &&
-                   track->getEvent(track_indices[i])->getTime() <= getTime()){
-                track->getEvent(track_indices[i])->run();
-                track_indices[i]++;
-            }
-        }
-    }
+int MergedCursor::numTracks() const
+{
+    return tracks.size();
 }
 
-std::string Playback::getTimeString() const
+uint64_t MergedCursor::nextTime() const
 {
-    unsigned long time = getTime();
-    std::ostringstream tstr;
-    tstr << time / 60000 << ":" << std::setfill('0') << std::setw(2)
-        << (time % 60000) / 1000;
-    return tstr.str();
+    if (heap.empty()){
+        return UINT64_MAX;
+    }
+    return heap.front().time;
 }
 
-MIDIData::MIDIData(Viewport* view) : view(view), filename("")
+MIDIData::MIDIData() : loading(false), filename("")
 {}
 
 void MIDIData::fillTrack()
@@ -346,7 +397,8 @@ void MIDIData::newTrack()
 
 
 
-    tracks.push_back(Track());
+    arenas.emplace_back(new Arena);
+    tracks.push_back(Track(arenas.back().get()));
     tracks[tracks.size() - 1].setColour(r_bank[idx], g_bank[idx], b_bank[idx]);
 
 	//generate new colour for next track
@@ -356,4 +408,40 @@ void MIDIData::newTrack()
 void MIDIData::clear()
 {
     tracks.clear();
+    arenas.clear();
+    tempo_map = TempoMap();
+    loading = false;
+}
+
+void MIDIData::swap(MIDIData& other)
+{
+    std::swap(arenas, other.arenas);
+    std::swap(tracks, other.tracks);
+    std::swap(tempo_map, other.tempo_map);
+    std::swap(loading, other.loading);
+}
+
+const TempoMap& MIDIData::getTempoMap() const
+{
+    return tempo_map;
+}
+
+void MIDIData::setTempoMap(const TempoMap& tempo_map)
+{
+    this->tempo_map = tempo_map;
+}
+
+bool MIDIData::isLoading() const
+{
+    return loading;
+}
+
+void MIDIData::setLoading(bool loading)
+{
+    this->loading = loading;
+}
+
+std::mutex& MIDIData::getMutex()
+{
+    return mutex;
 }
@@ -20,162 +20,299 @@
 #include <vector>
 #include <string>
 #include <memory>
-#include <chrono>
-#include "Synth.h"
+#include <cstdint>
+#include <algorithm>
+#include <mutex>
+#include <exception>
+#include "TempoMap.h"
+#include "IntervalIndex.h"
+#include "NoteSummary.h"
+#include "Arena.h"
 
-class Viewport;
-class Playback;
-class NoteEditor;
 class Track;
 class MIDIData;
 
-class Event {
-public:
-    Event(Viewport* view, Track* track, std::string type, unsigned long time)
-          : view(view), track(track), type(type), time(time) {}
-    virtual ~Event(){}
-
-    std::string getType() const { return type; }
-    unsigned long getTime() const { return time; }
-    virtual int getDuration() const { return 0; }
-    virtual void setDuration(int duration) { return; }
-    //executed when we reach this event during playback
-    virtual void run() = 0;
-    //executed when the note is to be drawn on the note editor
-    virtual void draw() = 0;
-
-protected:
-    Viewport* view;
-    Track* track;
-
-private:
-    std::string type;
-    //absolute time the event occurs, in ms
-    unsigned long time;
-};
-
-class ChannelEvent : public Event {
-public:
-    ChannelEvent(Viewport* view, Track* track, std::string type,
-                 unsigned long time, short channel)
-                 : Event(view, track, type, time), channel(channel) {}
-    virtual ~ChannelEvent(){}
-
-    short getChannel() const { return channel; }
-
-private:
-    short channel;
+//what an event does, stored as one byte per event in a Track
+enum class EventKind : unsigned char {
+    NoteOn,
+    NoteOff,
+    ProgramChange
 };
 
-class NoteOn : public ChannelEvent {
-public:
-    NoteOn(Viewport* view, Track* track, unsigned long time, short channel, short value,
-         short velocity, int duration);
-
-    short getValue() const;
-    virtual int getDuration() const;
-    virtual void setDuration(int duration);
-    virtual void run();
-    virtual void draw();
+//plain value used to pass single events into and out of a Track,
+//Tracks themselves store their events column by column
+struct Event {
+    Event(EventKind kind, uint64_t tick, uint64_t time, short channel, short value,
+          short velocity = 0, uint32_t duration = 0)
+          : kind(kind), channel(channel), value(value), velocity(velocity),
+            tick(tick), time(time), duration(duration) {}
 
-private:
+    EventKind kind;
     short channel;
+    //note value for NoteOn/NoteOff, voice for ProgramChange
     short value;
     short velocity;
-    //time until associated noteOff event, stored to simplify drawing
-    int duration;
+    //absolute position of the event in MIDI ticks, this is what gets saved.
+    //Tracks don't store it, it's worked back out of time through the tempo map
+    uint64_t tick;
+    //the same position in us, converted through the tempo map
+    uint64_t time;
+    //us until associated NoteOff event, stored to simplify drawing
+    uint32_t duration;
 };
 
-class NoteOff : public ChannelEvent {
-public:
-    NoteOff(Viewport* view, Track *track, unsigned long time, short channel, short value);
+//storage for one field of every event in a Track
+template <class T>
+using Column = std::vector<T, ArenaAllocator<T>>;
 
-    short getValue() const;
-    virtual void run();
-    virtual void draw();
+//what a seek has to restore on the 16 MIDI channels
+struct ChannelState {
+    struct HeldNote {
+        uint8_t channel;
+        uint8_t key;
+        uint8_t velocity;
+    };
 
-private:
-    short value;
+    ChannelState();
+
+    //-1 while no program change has been seen on the channel
+    short programs[16];
+    //time of each program change, so the latest one wins across tracks
+    uint64_t program_times[16];
+    std::vector<HeldNote> held_notes;
 };
 
-class ProgramChange : public ChannelEvent {
+//snapshots of the channel state left by one track's events, taken every
+//second of song time, so the state at any time can be found by replaying
+//a short stretch of events from the nearest one
+class ChannelCheckpoints {
 public:
-    ProgramChange(Viewport* view, Track *track, unsigned long time, short channel, short voice);
-
-    short getVoice() const;
-    virtual void run();
-    virtual void draw();
+    void build(const Track& track);
+    //adds the state left by the track's events before time into state
+    void stateAt(const Track& track, uint64_t time, ChannelState& state) const;
 
 private:
-    short voice;
+    //programs set by the track, only stored again when they change
+    struct Programs {
+        short programs[16];
+        uint64_t program_times[16];
+    };
+    //one per CHECKPOINT_INTERVAL, the first at time 0
+    struct Checkpoint {
+        //first event at or after the checkpoint's time, the snapshot includes
+        //every one before it
+        int event;
+        //index in programs, -1 until the track has changed one
+        int programs;
+        //range of held_notes, shared with the previous checkpoint when the
+        //same notes are held
+        uint32_t notes_begin, notes_end;
+    };
+
+    std::vector<Checkpoint> checkpoints;
+    std::vector<Programs> programs;
+    std::vector<ChannelState::HeldNote> held_notes;
 };
 
 class Track {
 public:
-    Track();
+    //the track's events are allocated from arena, or the heap if it's null
+    Track(Arena* arena = nullptr);
 
-    //returns the total duration of this track in ms
-    unsigned long getDuration() const;
-    void addEvent(std::shared_ptr<Event> ev);
-    void appendEvent(std::shared_ptr<Event> ev);
-    void removeEvent(std::shared_ptr<Event> ev);
+    //returns the total duration of this track in us
+    uint64_t getDuration() const;
+    //inserts the event in time order, returns the index it was stored at.
+    //Both throw InvalidEvent if the channel, value or velocity is out of
+    //MIDI's range, so everything reading the columns can index by them.
+    int addEvent(const Event& ev);
+    void appendEvent(const Event& ev);
+    void removeEvent(int index);
     //removes the NoteOn and NoteOff events of any note of this value occurring at time
-    void removeNotesAt(unsigned long time, int value);
+    void removeNotesAt(uint64_t time, int value);
     int numEvents() const;
-    std::shared_ptr<Event> getEvent(int index) const;
+    void reserve(int num_events);
+    Event getEvent(int index, const TempoMap& tempo_map) const;
     //returns index of first event occurring at or after this time, or -1
     //if there are no such events
-    int getEventAt(long time) const;
+    int getEventAt(int64_t time) const;
+    //adds the channel state left by this track's events before time into state
+    void getChannelState(uint64_t time, ChannelState& state) const;
+
+    //per-event accessors, index must be in [0, numEvents())
+    EventKind getKind(int index) const { return kinds[index]; }
+    //the inverse of the tempo map, exact as long as a tick lasts at least 1us
+    uint64_t getTick(int index, const TempoMap& tempo_map) const
+    {
+        return tempo_map.microsToTick(times[index]);
+    }
+    uint64_t getTime(int index) const { return times[index]; }
+    short getChannel(int index) const { return channels[index]; }
+    short getValue(int index) const { return values[index]; }
+    short getVelocity(int index) const { return velocities[index]; }
+    uint32_t getNoteDuration(int index) const { return durations[index]; }
+    void setNoteDuration(int index, uint32_t duration);
+
+    //calls func(index) in time order for every NoteOn sounding at some point
+    //in [t0, t1] (times in us), stopping early if func returns false
+    template <class Func>
+    void forNotesIn(uint64_t t0, uint64_t t1, Func func) const
+    {
+        updateNoteIndex();
+        const std::vector<int>& notes = note_events;
+        auto start = [&](int i) { return times[notes[i]]; };
+        auto end = [&](int i) { return times[notes[i]] + durations[notes[i]]; };
+        note_index.query(t0, t1, start, end, [&](int i) { return func(notes[i]); });
+    }
+
+    //calls func(value, start, end) for every run of notes of one value
+    //sounding at some point in [t0, t1], with notes less than resolution (in
+    //us) apart merged into one run. Returns false without calling func if
+    //the track is too sparse at that resolution for this to beat forNotesIn.
+    template <class Func>
+    bool forNoteSpansIn(uint64_t t0, uint64_t t1, uint64_t resolution, Func func) const
+    {
+        updateNoteIndex();
+        int level = NoteSummary::levelFor(resolution, note_events.size(), getDuration());
+        if (level < 0){
+            return false;
+        }
+        if (note_summary_dirty){
+            note_summary.build(note_events, times.data(), durations.data(), values.data());
+            note_summary_dirty = false;
+        }
+        note_summary.query(level, t0, t1, func);
+        return true;
+    }
 
     //this track's NoteOns will be drawn in this colour on the NoteOnEditor
     void setColour(char r, char g, char b);
     void getColour(char &r, char &g, char &b) const;
 
+    class InvalidEvent : public std::exception {
+    public:
+        InvalidEvent(std::string error) : error(error) {}
+        virtual const char* what() const noexcept { return error.c_str(); }
+    private:
+        std::string error;
+    };
+
 private:
-    std::vector<std::shared_ptr<Event>> events;
+    //reads and writes the columns directly
+    friend class MIDICache;
+
+    void insertAt(int index, const Event& ev);
+    //rebuilds the note index if events were added or removed since the last query
+    void updateNoteIndex() const;
+
+    //one entry per event in each column, sorted by time, 16 bytes per event
+    //in all. Ticks aren't stored since they follow from the times
+    Arena* arena;
+    Column<uint64_t> times;
+    Column<uint32_t> durations;
+    Column<EventKind> kinds;
+    Column<uint8_t> channels;
+    Column<uint8_t> values;
+    Column<uint8_t> velocities;
     char r, g, b;
+
+    //indices of this track's NoteOns, and an interval index over them
+    mutable std::vector<int> note_events;
+    mutable IntervalIndex note_index;
+    mutable bool note_index_dirty;
+    //outlines of the notes for drawing zoomed out, rebuilt when first needed
+    //after the notes change
+    mutable NoteSummary note_summary;
+    mutable bool note_summary_dirty;
+    mutable ChannelCheckpoints checkpoints;
+    mutable bool checkpoints_dirty;
 };
 
-class Playback {
+//walks the events of many tracks together in time order. Tracks are kept in
+//a min-heap on the time of their next event, so stepping past k due events
+//costs O(k log T) however many tracks T there are.
+class MergedCursor {
 public:
-    Playback(Viewport* view);
-
-    //current playback time
-    unsigned long getTime() const;
-    bool isPlaying() const { return playing; }
-    Synth* getSynth();
-    void seek(unsigned long time);
-    void pause();
-    void play();
-    //adds new indices if necessary (i.e. if we added a track), leaves existing indices unmodified
-    void updateIndices();
-    //method called every frame, this actually plays notes
-    void everyFrame();
-    std::string getTimeString() const;
+    MergedCursor();
+
+    //moves to the first event at or after time in each of tracks, must be
+    //called again whenever events are added to or removed from them
+    void reset(const std::vector<const Track*>& tracks, uint64_t time);
+    int numTracks() const;
+    //time of the earliest event not stepped past yet, UINT64_MAX if there are none
+    uint64_t nextTime() const;
+
+    //steps past every event at or before time, calling func(track, begin, end)
+    //for each track's run of events [begin, end)
+    template <class Func>
+    void advance(uint64_t time, Func func)
+    {
+        while (!heap.empty() && heap.front().time <= time){
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Entry& next = heap.back();
+            const Track* track = tracks[next.track];
+            int num_events = track->numEvents();
+            int begin = indices[next.track];
+            int end = begin + 1;
+            while (end < num_events && track->getTime(end) <= time){
+                end++;
+            }
+            func(track, begin, end);
+
+            indices[next.track] = end;
+            if (end < num_events){
+                next.time = track->getTime(end);
+                std::push_heap(heap.begin(), heap.end(), later);
+            } else {
+                heap.pop_back();
+            }
+        }
+    }
 
 private:
-    Viewport* view;
-    Synth synth;
-    std::chrono::steady_clock::time_point start_time;
-    //for storing the time when we pause
-    unsigned long time_elapsed;
-    bool playing;
-    std::vector<int> track_indices;
+    struct Entry {
+        uint64_t time; //of the track's next event
+        int track;
+    };
+
+    static bool later(const Entry& a, const Entry& b) { return a.time > b.time; }
+
+    std::vector<const Track*> tracks;
+    //next event of each track
+    std::vector<int> indices;
+    std::vector<Entry> heap;
 };
 
 class MIDIData {
 public:
-    MIDIData(Viewport* view);
+    MIDIData();
 
     int numTracks() const;
     Track* getTrack(int index);
     void newTrack();
     void fillTrack();
     void clear();
+    //exchanges the tracks and tempo map with other's, hold both mutexes
+    //unless other is private to the caller
+    void swap(MIDIData& other);
+    //converts between MIDI ticks and the us stored in every Track
+    const TempoMap& getTempoMap() const;
+    void setTempoMap(const TempoMap& tempo_map);
+    //set while a file is still being loaded into the tracks, they must not
+    //be edited until it's done
+    bool isLoading() const;
+    void setLoading(bool loading);
+    //the sequencer thread holds this while reading the tracks, so hold it
+    //while changing them
+    std::mutex& getMutex();
 
 private:
-    Viewport* view;
+    //one arena per track so tracks can be filled from different threads,
+    //they outlive the tracks and free all events at once in clear()
+    std::vector<std::unique_ptr<Arena>> arenas;
     std::vector<Track> tracks;
+    TempoMap tempo_map;
+    bool loading;
+    std::mutex mutex;
     std::string filename;
 };
 
@@ -0,0 +1,311 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <vector>
+#include <fstream>
+#include <sys/stat.h>
+#include "MIDICache.h"
+#include "MappedFile.h"
+#include "MIDI.h"
+
+#define CACHE_EXTENSION ".mmcache"
+#define CACHE_MAGIC "MMIDIC\r\n"
+//bump whenever the layout below or the meaning of any column changes
+#define CACHE_VERSION 3
+#define ENDIAN_CHECK 0x01020304
+
+//all sections start 8-byte aligned so the columns can be read in place
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian_check;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+    uint32_t division;
+    uint32_t num_tracks;
+    uint32_t num_tempo_changes;
+    uint32_t reserved;
+};
+
+struct CacheTempoChange {
+    uint64_t tick;
+    uint32_t tempo;
+    uint32_t reserved;
+};
+
+struct CacheTrackHeader {
+    uint64_t num_events;
+    //checked against the columns on load
+    uint32_t num_note_ons;
+    uint32_t num_note_offs;
+};
+
+static size_t padded(size_t bytes)
+{
+    return (bytes + 7) & ~size_t(7);
+}
+
+//fast 64-bit hash of the whole file, 8 bytes at a time
+static uint64_t hashBytes(const uint8_t* data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        h = (h ^ word) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h ^ (h >> 32);
+}
+
+//copies n elements into column and advances pos past its padding
+template<class T>
+static void readColumn(Column<T>& column, size_t n, const uint8_t*& pos)
+{
+    const T* first = reinterpret_cast<const T*>(pos);
+    column.assign(first, first + n);
+    pos += padded(n * sizeof(T));
+}
+
+template<class T>
+static void writeColumn(const Column<T>& column, std::ofstream& out)
+{
+    static const char zeros[8] = { 0 };
+    size_t bytes = column.size() * sizeof(T);
+    out.write(reinterpret_cast<const char*>(column.data()), bytes);
+    out.write(zeros, padded(bytes) - bytes);
+}
+
+MIDICache::MIDICache(std::string source_filename)
+                    : source_filename(source_filename),
+                      cache_filename(source_filename + CACHE_EXTENSION),
+                      source_ok(false), source_size(0), source_mtime(0), source_hash(0),
+                      cancelled(false), done(false)
+{
+    struct stat st;
+    if (stat(source_filename.c_str(), &st) != 0) {
+        return;
+    }
+    try {
+        MappedFile source(source_filename);
+        source_size = source.size();
+        source_mtime = st.st_mtime;
+        source_hash = hashBytes(source.data(), source.size());
+        source_ok = true;
+    } catch (std::exception &e) {
+    }
+}
+
+MIDICache::~MIDICache()
+{
+    cancelled = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+bool MIDICache::load(MIDIData* data) const
+{
+    if (!source_ok) {
+        return false;
+    }
+
+    try {
+        MappedFile cache(cache_filename);
+        const uint8_t* pos = cache.data();
+        const uint8_t* end = pos + cache.size();
+
+        CacheHeader header;
+        if (cache.size() < sizeof(header)) {
+            return false;
+        }
+        std::memcpy(&header, pos, sizeof(header));
+        pos += sizeof(header);
+        if (std::memcmp(header.magic, CACHE_MAGIC, 8) != 0 || header.version != CACHE_VERSION
+                || header.endian_check != ENDIAN_CHECK || header.source_size != source_size
+                || header.source_mtime != source_mtime || header.source_hash != source_hash
+                || header.division == 0) {
+            return false;
+        }
+
+        if (static_cast<size_t>(end - pos) < header.num_tempo_changes * sizeof(CacheTempoChange)) {
+            return false;
+        }
+        std::vector<TempoMap::TempoChange> changes;
+        for (uint32_t i = 0; i < header.num_tempo_changes; i++) {
+            CacheTempoChange change;
+            std::memcpy(&change, pos, sizeof(change));
+            pos += sizeof(change);
+            TempoMap::TempoChange tc = { change.tick, change.tempo };
+            changes.push_back(tc);
+        }
+        TempoMap tempo_map(header.division);
+        tempo_map.setTempoChanges(changes);
+        data->setTempoMap(tempo_map);
+
+        for (uint32_t i = 0; i < header.num_tracks; i++) {
+            CacheTrackHeader track_header;
+            if (static_cast<size_t>(end - pos) < sizeof(track_header)) {
+                data->clear();
+                return false;
+            }
+            std::memcpy(&track_header, pos, sizeof(track_header));
+            pos += sizeof(track_header);
+
+            size_t n = track_header.num_events;
+            size_t column_bytes = padded(n * sizeof(uint64_t)) + padded(n * sizeof(uint32_t))
+                                  + 4 * padded(n);
+            if (n > INT32_MAX || static_cast<size_t>(end - pos) < column_bytes) {
+                data->clear();
+                return false;
+            }
+
+            data->newTrack();
+            Track* track = data->getTrack(data->numTracks() - 1);
+            track->reserve(static_cast<int>(n));
+            readColumn(track->times, n, pos);
+            readColumn(track->durations, n, pos);
+            readColumn(track->kinds, n, pos);
+            readColumn(track->channels, n, pos);
+            readColumn(track->values, n, pos);
+            readColumn(track->velocities, n, pos);
+            if (!checkTrack(*track, track_header.num_note_ons, track_header.num_note_offs)) {
+                data->clear();
+                return false;
+            }
+            track->note_index_dirty = true;
+            track->checkpoints_dirty = true;
+        }
+        return true;
+    } catch (std::exception &e) {
+        data->clear();
+        return false;
+    }
+}
+
+bool MIDICache::checkTrack(const Track& track, uint32_t num_note_ons, uint32_t num_note_offs)
+{
+    uint32_t note_ons = 0;
+    uint32_t note_offs = 0;
+    size_t n = track.kinds.size();
+    for (size_t i = 0; i < n; i++) {
+        if (track.channels[i] > 15 || track.values[i] > 127 || track.velocities[i] > 127) {
+            return false;
+        }
+        if (i > 0 && track.times[i] < track.times[i - 1]) {
+            return false;
+        }
+        switch (track.kinds[i]) {
+        case EventKind::NoteOn:
+            note_ons++;
+            break;
+        case EventKind::NoteOff:
+            note_offs++;
+            break;
+        case EventKind::ProgramChange:
+            break;
+        default:
+            return false;
+        }
+    }
+    return note_ons == num_note_ons && note_offs == num_note_offs;
+}
+
+void MIDICache::start(MIDIData* data)
+{
+    done = false;
+    thread = std::thread([this, data]() {
+        save(data);
+        done = true;
+    });
+}
+
+bool MIDICache::finished() const
+{
+    return done;
+}
+
+void MIDICache::save(MIDIData* data)
+{
+    if (!source_ok) {
+        return;
+    }
+
+    //write to a temporary file first so a half-written cache is never picked up
+    std::string tmp_filename = cache_filename + ".tmp";
+    std::ofstream out(tmp_filename.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return;
+    }
+
+    std::vector<TempoMap::TempoChange> changes = data->getTempoMap().getTempoChanges();
+    CacheHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, CACHE_MAGIC, 8);
+    header.version = CACHE_VERSION;
+    header.endian_check = ENDIAN_CHECK;
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+    header.source_hash = source_hash;
+    header.division = data->getTempoMap().getDivision();
+    header.num_tracks = data->numTracks();
+    header.num_tempo_changes = changes.size();
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    for (auto &tc : changes) {
+        CacheTempoChange change = { tc.tick, tc.tempo, 0 };
+        out.write(reinterpret_cast<const char*>(&change), sizeof(change));
+    }
+
+    for (int i = 0; i < data->numTracks() && !cancelled; i++) {
+        const Track* track = data->getTrack(i);
+        CacheTrackHeader track_header = { static_cast<uint64_t>(track->numEvents()), 0, 0 };
+        for (int j = 0; j < track->numEvents(); j++) {
+            if (track->kinds[j] == EventKind::NoteOn) {
+                track_header.num_note_ons++;
+            } else if (track->kinds[j] == EventKind::NoteOff) {
+                track_header.num_note_offs++;
+            }
+        }
+        out.write(reinterpret_cast<const char*>(&track_header), sizeof(track_header));
+
+        writeColumn(track->times, out);
+        writeColumn(track->durations, out);
+        writeColumn(track->kinds, out);
+        writeColumn(track->channels, out);
+        writeColumn(track->values, out);
+        writeColumn(track->velocities, out);
+    }
+
+    out.close();
+    if (!out || cancelled) {
+        std::remove(tmp_filename.c_str());
+        return;
+    }
+    //rename doesn't replace existing files on Windows
+    std::remove(cache_filename.c_str());
+    if (std::rename(tmp_filename.c_str(), cache_filename.c_str()) != 0) {
+        std::remove(tmp_filename.c_str());
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef MIDICACHE_H
+#define MIDICACHE_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+
+class MIDIData;
+class Track;
+
+//sidecar file next to a MIDI file holding its already parsed tracks, so
+//reopening it is a matter of copying the columns back in. A cache is only
+//used if the size, modification time and contents hash of the MIDI file
+//still match what was recorded when it was written, and every event read
+//back is in range and in time order.
+class MIDICache {
+public:
+    MIDICache(std::string source_filename);
+    //stops a save still going on in the background, without writing the cache
+    ~MIDICache();
+
+    //fills data from the cache, returns false if there's no valid cache,
+    //leaving data empty
+    bool load(MIDIData* data) const;
+    //writes the cache for data, which must have been loaded from the source
+    //file; failing to write (e.g. read-only directory) is not an error
+    void save(MIDIData* data);
+    //save() on a background thread; data's tracks must not change until
+    //finished() returns true, but can go on being read meanwhile
+    void start(MIDIData* data);
+    bool finished() const;
+
+private:
+    //whether the columns just read for track hold valid events, and as many
+    //NoteOns and NoteOffs as the cache recorded
+    static bool checkTrack(const Track& track, uint32_t num_note_ons, uint32_t num_note_offs);
+
+    std::string source_filename;
+    std::string cache_filename;
+    bool source_ok;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint64_t source_hash;
+    std::thread thread;
+    std::atomic<bool> cancelled;
+    std::atomic<bool> done;
+};
+
+#endif /* MIDICACHE_H */
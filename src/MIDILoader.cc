@@ -15,158 +15,446 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <vector>
-#include <sstream>
+#include <deque>
+#include <algorithm>
+#include <cstring>
 #include <memory>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include "Viewport.h"
+#include <sstream>
 #include "MIDI.h"
 #include "MIDILoader.h"
-#include "libmidi/libmidi.h"
+#include "WorkerPool.h"
+
+#define STATUS_NOTE_OFF 0x80
+#define STATUS_NOTE_ON 0x90
+#define STATUS_PROGRAM_CHANGE 0xC0
+#define STATUS_SYSEX 0xF0
+#define STATUS_SYSEX_ESCAPE 0xF7
+#define STATUS_META 0xFF
+#define META_END_OF_TRACK 0x2F
+#define META_TEMPO 0x51
+//the first slice decoded in the background covers this much time (in us),
+//each following one twice as much as the last, up to MAX_SLICE_LENGTH
+#define FIRST_SLICE_LENGTH 2000000
+#define MAX_SLICE_LENGTH 16000000
+//publish() stops handing over slices once it has this many events, so the
+//sequencer isn't kept waiting on the tracks for long
+#define PUBLISH_BATCH 65536
 
-MIDILoader::MIDILoader(std::string filename, Viewport* view)
-                      : filename(filename), view(view)
+static uint32_t readBE32(const uint8_t* p)
 {
-    int r = MIDIFile_load(&midi_file, filename.c_str());
-    switch (r) {
-        case MIDIError::FILE_IO_ERROR:
-            throw LibmidiError(std::string("Failed to open file!"));
-        case MIDIError::FILE_INVALID:
-            throw LibmidiError(std::string("Invalid MIDI file!"));
-        case MIDIError::MEMORY_ERROR:
-            throw LibmidiError(std::string("Memory allocation error!"));
-    }
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
 }
 
-MIDILoader::~MIDILoader()
+static uint16_t readBE16(const uint8_t* p)
 {
-    MIDIFile_delete(&midi_file);
+    return (uint16_t(p[0]) << 8) | p[1];
 }
 
+//walks the events of one MTrk chunk, handling running status
+class ChunkReader {
+public:
+    ChunkReader(const uint8_t* data, size_t length)
+               : pos(data), end(data + length), running_status(0) {}
+
+    //reads the next event into the public fields, returns false at end of track
+    bool next()
+    {
+        if (pos >= end) {
+            return false;
+        }
+        delta = readVarLen();
+        if (pos >= end) {
+            throw MIDILoader::LoadError("Invalid MIDI file: truncated track!");
+        }
+
+        if (*pos & 0x80) {
+            status = *pos++;
+        } else if (running_status) {
+            status = running_status;
+        } else {
+            throw MIDILoader::LoadError("Invalid MIDI file: missing status byte!");
+        }
+
+        if (status == STATUS_META) {
+            running_status = 0;
+            need(1);
+            meta_type = *pos++;
+            data_length = readVarLen();
+            need(data_length);
+            data = pos;
+            pos += data_length;
+            return meta_type != META_END_OF_TRACK;
+        } else if (status == STATUS_SYSEX || status == STATUS_SYSEX_ESCAPE) {
+            running_status = 0;
+            data_length = readVarLen();
+            need(data_length);
+            data = pos;
+            pos += data_length;
+        } else {
+            running_status = status;
+            //program change and channel pressure have one parameter, the rest two
+            int num_params = ((status & 0xF0) == 0xC0 || (status & 0xF0) == 0xD0) ? 1 : 2;
+            need(num_params);
+            param1 = pos[0] & 0x7F;
+            param2 = num_params == 2 ? pos[1] & 0x7F : 0;
+            pos += num_params;
+        }
+        return true;
+    }
+
+    //bytes of the chunk not read yet
+    size_t remaining() const
+    {
+        return end - pos;
+    }
+
+    uint32_t delta;
+    uint8_t status;
+    uint8_t param1, param2;
+    uint8_t meta_type;
+    const uint8_t* data;
+    uint32_t data_length;
 
-std::mutex t_err_mutex;
-int t_err = MIDIError::SUCCESS;
+private:
+    uint32_t readVarLen()
+    {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) {
+            need(1);
+            uint8_t byte = *pos++;
+            value = (value << 7) | (byte & 0x7F);
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw MIDILoader::LoadError("Invalid MIDI file: bad variable-length value!");
+    }
+
+    void need(size_t bytes) const
+    {
+        if (static_cast<size_t>(end - pos) < bytes) {
+            throw MIDILoader::LoadError("Invalid MIDI file: truncated track!");
+        }
+    }
+
+    const uint8_t* pos;
+    const uint8_t* end;
+    uint8_t running_status;
+};
+
+struct MIDILoader::TrackDecoder {
+    TrackDecoder(const TrackChunk& chunk, const TempoMap& tempo_map)
+                : reader(chunk.data, chunk.length), tempo(tempo_map), tick(0),
+                  finished(false), first_decoded(0)
+    {
+        std::fill(note_ons, note_ons + 128, -1);
+        std::fill(note_on_times, note_on_times + 128, 0);
+    }
+
+    ChunkReader reader;
+    TempoMap::Cursor tempo;
+    uint64_t tick;
+    bool finished;
+    //events decoded in the current slice; the first of them will be event
+    //number first_decoded of the track
+    std::vector<Event> decoded;
+    int first_decoded;
+    //track event number of each note's NoteOn, so we can update its
+    //duration when the NoteOff is encountered
+    int note_ons[128];
+    uint64_t note_on_times[128];
+    //durations of NoteOns handed over in earlier slices, by event number
+    std::vector<std::pair<int, uint32_t>> decoded_durations;
+
+    //handed over and waiting for publish(), guarded by ready_mutex, with
+    //the number of events and durations in each slice
+    std::deque<Event> ready;
+    std::deque<std::pair<int, uint32_t>> ready_durations;
+    std::deque<std::pair<size_t, size_t>> ready_slices;
+};
+
+MIDILoader::MIDILoader(std::string filename, MIDIData* data)
+                      : filename(filename), data(data), file(filename), prepared(false), cancelled(false),
+                        bytes_decoded(0), total_bytes(0), done(false)
+{
+    const uint8_t* bytes = file.data();
+    size_t size = file.size();
+
+    if (size < 14 || std::memcmp(bytes, "MThd", 4) != 0 || readBE32(bytes + 4) < 6) {
+        throw LoadError(std::string("Invalid MIDI file!"));
+    }
+    format = readBE16(bytes + 8);
+    int num_tracks = readBE16(bytes + 10);
+    division = readBE16(bytes + 12);
+    if (division == 0) {
+        throw LoadError(std::string("Invalid MIDI file!"));
+    }
+    tempo_map = TempoMap(division);
+
+    //locate every track chunk in one pass, skipping unknown chunk types
+    size_t offset = 8 + readBE32(bytes + 4);
+    chunks.reserve(num_tracks);
+    while (offset + 8 <= size) {
+        size_t length = readBE32(bytes + offset + 4);
+        //be lenient with files whose last chunk is cut short
+        if (length > size - offset - 8) {
+            length = size - offset - 8;
+        }
+        if (std::memcmp(bytes + offset, "MTrk", 4) == 0) {
+            TrackChunk chunk = { bytes + offset + 8, length };
+            chunks.push_back(chunk);
+        }
+        offset += 8 + length;
+    }
+
+    if (chunks.empty() && num_tracks > 0) {
+        throw LoadError(std::string("Invalid MIDI file!"));
+    }
+}
+
+
+MIDILoader::~MIDILoader()
+{
+    cancelled = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
 
 void MIDILoader::load()
 {
-    std::vector<std::thread> workers(midi_file.header.num_tracks);
-    for (int i = 0; i < midi_file.header.num_tracks; i++) {
-        view->getMIDIData()->newTrack();
+    if (!prepared) {
+        prepare();
     }
-    for (int i = 0; i < midi_file.header.num_tracks; i++){
-        workers[i] = std::thread(&MIDILoader::loadTrack, this,
-                                 view->getMIDIData()->getTrack(i), i);
+    createTracks();
+    decodeAll();
+    while (!publish()) {
     }
+}
 
-    for (auto &t : workers) {
-        t.join();
+void MIDILoader::start()
+{
+    if (!prepared) {
+        prepare();
     }
+    createTracks();
+    thread = std::thread(&MIDILoader::decodeAll, this);
+}
 
+bool MIDILoader::publish()
+{
+    //take whole slices, the same ones for every track so they all stay in
+    //step, until there are enough events to go on with
+    std::vector<std::vector<Event>> events(decoders.size());
+    std::vector<std::vector<std::pair<int, uint32_t>>> durations(decoders.size());
+    bool all_in;
     {
-        std::lock_guard<std::mutex> lk(t_err_mutex);
-        switch (t_err) {
-        case MIDIError::FILE_INVALID:
-            t_err = MIDIError::SUCCESS;
-            throw LibmidiError(std::string("Invalid MIDI file in worker thread!"));
-        case MIDIError::FILE_IO_ERROR:
-            t_err = MIDIError::SUCCESS;
-            throw LibmidiError(std::string("File IO error in worker thread!"));
-        case MIDIError::MEMORY_ERROR:
-            t_err = MIDIError::SUCCESS;
-            throw LibmidiError(std::string("Memory allocation error in worker thread!"));
+        std::lock_guard<std::mutex> lk(ready_mutex);
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        size_t num_events = 0;
+        while (num_events < PUBLISH_BATCH && !decoders.empty() &&
+               !decoders[0]->ready_slices.empty()) {
+            for (size_t i = 0; i < decoders.size(); i++) {
+                TrackDecoder& decoder = *decoders[i];
+                std::pair<size_t, size_t> slice = decoder.ready_slices.front();
+                decoder.ready_slices.pop_front();
+                events[i].insert(events[i].end(), decoder.ready.begin(),
+                                 decoder.ready.begin() + slice.first);
+                decoder.ready.erase(decoder.ready.begin(), decoder.ready.begin() + slice.first);
+                durations[i].insert(durations[i].end(), decoder.ready_durations.begin(),
+                                    decoder.ready_durations.begin() + slice.second);
+                decoder.ready_durations.erase(decoder.ready_durations.begin(),
+                                              decoder.ready_durations.begin() + slice.second);
+                num_events += slice.first;
+            }
+        }
+        all_in = done && (decoders.empty() || decoders[0]->ready_slices.empty());
+    }
+
+    //only the appending holds up the sequencer
+    std::lock_guard<std::mutex> data_lock(data->getMutex());
+    for (size_t i = 0; i < decoders.size(); i++) {
+        Track* track = data->getTrack(i);
+        for (auto &ev : events[i]) {
+            track->appendEvent(ev);
         }
+        for (auto &duration : durations[i]) {
+            track->setNoteDuration(duration.first, duration.second);
+        }
+    }
+    return all_in;
+}
+
+bool MIDILoader::hasReady()
+{
+    std::lock_guard<std::mutex> lk(ready_mutex);
+    return !decoders.empty() && !decoders[0]->ready_slices.empty();
+}
+
+double MIDILoader::progress() const
+{
+    if (total_bytes == 0) {
+        return 1.0;
+    }
+    return static_cast<double>(bytes_decoded) / total_bytes;
+}
+
+void MIDILoader::prepare()
+{
+    int num_tracks = chunks.size();
+    std::vector<std::vector<TempoMap::TempoChange>> tempo_changes(num_tracks);
+    event_counts.assign(num_tracks, 0);
+
+    //in format 1 files the tempo changes for every track usually live in the
+    //conductor track, so all tempo changes go into one map shared by all tracks
+    forEachTrack([&](int i) { scanTrack(i, tempo_changes[i], event_counts[i]); });
+    std::vector<TempoMap::TempoChange> all_changes;
+    for (auto &changes : tempo_changes) {
+        all_changes.insert(all_changes.end(), changes.begin(), changes.end());
     }
+    tempo_map.setTempoChanges(all_changes);
+    prepared = true;
 }
 
-void deleteLibmidiTrack(MIDITrack* trk)
+void MIDILoader::createTracks()
 {
-    MIDITrack_delete_events(trk);
-    delete trk;
+    data->setTempoMap(tempo_map);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        data->newTrack();
+        data->getTrack(i)->reserve(event_counts[i]);
+        decoders.emplace_back(new TrackDecoder(chunks[i], tempo_map));
+        total_bytes += chunks[i].length;
+    }
 }
 
-void MIDILoader::loadTrack(Track* midi_data_track, int tracknum)
+void MIDILoader::decodeAll()
 {
-    MIDIFile new_midi; //each thread needs its own separate MIDIFile handler
-    //locally reopen the same file
-    int r = MIDIFile_load(&new_midi, filename.c_str());
-    if (r != MIDIError::SUCCESS) {
-        std::lock_guard<std::mutex> lk(t_err_mutex);
-        t_err = r;
-        std::fclose(new_midi.file);
-        return;
-    }
-
-    //skip to the correct track
-    for (int i = 0; i < tracknum; i++) {
-        r = MIDITrack_skip(new_midi.file);
-        if (r != MIDIError::SUCCESS) {
-            std::lock_guard<std::mutex> lk(t_err_mutex);
-            t_err = r;
-            std::fclose(new_midi.file);
+    uint64_t until = FIRST_SLICE_LENGTH;
+    bool finished = false;
+
+    while (!finished && !cancelled) {
+        try {
+            forEachTrack([&](int i) { decodeTrack(i, until); });
+        } catch (...) {
+            std::lock_guard<std::mutex> lk(ready_mutex);
+            error = std::current_exception();
             return;
         }
+
+        std::lock_guard<std::mutex> lk(ready_mutex);
+        size_t remaining = 0;
+        finished = true;
+        for (auto &decoder : decoders) {
+            decoder->ready.insert(decoder->ready.end(), decoder->decoded.begin(),
+                                  decoder->decoded.end());
+            decoder->ready_durations.insert(decoder->ready_durations.end(),
+                                            decoder->decoded_durations.begin(),
+                                            decoder->decoded_durations.end());
+            decoder->ready_slices.push_back(std::make_pair(decoder->decoded.size(),
+                                                           decoder->decoded_durations.size()));
+            decoder->first_decoded += decoder->decoded.size();
+            decoder->decoded.clear();
+            decoder->decoded_durations.clear();
+            remaining += decoder->reader.remaining();
+            finished = finished && decoder->finished;
+        }
+        bytes_decoded = total_bytes - remaining;
+        done = finished;
+        until += std::min<uint64_t>(until, MAX_SLICE_LENGTH);
     }
+}
 
-    //now load the actual track
-    uint32_t conversion = MIDIHeader_getTempoConversion(&new_midi.header, 500000);
-    MIDITrack track_;
-    track_.list = nullptr;
-    std::shared_ptr<MIDITrack> track(&track_, MIDITrack_delete_events);
+void MIDILoader::forEachTrack(std::function<void(int)> func)
+{
+    int num_tracks = chunks.size();
+    std::vector<WorkerPool::Task> tasks;
+    std::vector<size_t> costs;
+    for (int i = 0; i < num_tracks; i++){
+        tasks.push_back(std::bind(func, i));
+        costs.push_back(chunks[i].length);
+    }
 
-    r = MIDITrack_load(track.get(), new_midi.file);
-    if (r != MIDIError::SUCCESS) {
-        std::lock_guard<std::mutex> lk(t_err_mutex);
-        t_err = r;
-        std::fclose(new_midi.file);
-        return;
+    std::vector<std::exception_ptr> errors = WorkerPool::shared().run(tasks, costs);
+    for (int i = 0; i < num_tracks; i++){
+        if (errors[i]) {
+            try {
+                std::rethrow_exception(errors[i]);
+            } catch (std::exception &e) {
+                std::ostringstream msg;
+                msg << "Track " << i << ": " << e.what();
+                throw LoadError(msg.str());
+            }
+        }
     }
+}
 
-    MIDIEventIterator iter = MIDIEventList_get_start_iter(track->list);
-    MIDIEvent* ev = MIDIEventList_get_event(iter);
-    unsigned long time = 0;
-    std::vector<NoteOn*> note_ons(128); //store NoteOns so we can update their durations
-                                   // when NoteOff is encountered.
-    for (int i = 0; i < 128; i++){
-      note_ons[i] = nullptr;
+void MIDILoader::scanTrack(int tracknum, std::vector<TempoMap::TempoChange>& tempo_changes,
+                           int& num_events)
+{
+    ChunkReader reader(chunks[tracknum].data, chunks[tracknum].length);
+    uint64_t tick = 0;
+
+    while (reader.next()){
+        tick += reader.delta;
+        uint8_t type = reader.status & 0xF0;
+        if (type == STATUS_NOTE_ON || type == STATUS_NOTE_OFF
+                || type == STATUS_PROGRAM_CHANGE){
+            num_events++;
+        } else if (reader.status == STATUS_META && reader.meta_type == META_TEMPO &&
+                   reader.data_length >= 3){
+            TempoMap::TempoChange change = { tick, (uint32_t(reader.data[0]) << 16)
+                                                   | (uint32_t(reader.data[1]) << 8)
+                                                   | reader.data[2] };
+            tempo_changes.push_back(change);
+        }
     }
+}
+
+void MIDILoader::decodeTrack(int tracknum, uint64_t until)
+{
+    TrackDecoder& decoder = *decoders[tracknum];
+    ChunkReader& reader = decoder.reader;
+    uint64_t time = 0; //in us
 
-    while (ev->type != META_END_TRACK){
-        time += (ev->delta_time * conversion);
+    while (!decoder.finished && time <= until && !cancelled){
+        if (!reader.next()){
+            decoder.finished = true;
+            break;
+        }
+        decoder.tick += reader.delta;
+        time = decoder.tempo.tickToMicros(decoder.tick);
+
+        uint8_t type = reader.status & 0xF0;
+        short channel = reader.status & 0x0F;
+        short value = reader.param1;
+        int event_number = decoder.first_decoded + decoder.decoded.size();
         //noteOn with non-zero velocity
-        if (ev->type == EV_NOTE_ON && static_cast<MIDIChannelEventData*>(ev->data)->param2){
-            NoteOn* tmp = new NoteOn(view, midi_data_track, time / 1000,
-                                     static_cast<MIDIChannelEventData*>(ev->data)->channel,
-                                     static_cast<MIDIChannelEventData*>(ev->data)->param1,
-                                     static_cast<MIDIChannelEventData*>(ev->data)->param2,
-                                     0);
-            note_ons[static_cast<MIDIChannelEventData*>(ev->data)->param1] = tmp;
-            midi_data_track->appendEvent(std::shared_ptr<Event>(tmp));
+        if (type == STATUS_NOTE_ON && reader.param2){
+            decoder.note_ons[value] = event_number;
+            decoder.note_on_times[value] = time;
+            decoder.decoded.push_back(Event(EventKind::NoteOn, decoder.tick, time, channel,
+                                            value, reader.param2));
         //NoteOffs
-        } else if (ev->type == EV_NOTE_ON || ev->type == EV_NOTE_OFF){
-            short channel = static_cast<MIDIChannelEventData*>(ev->data)->channel;
-            short value = static_cast<MIDIChannelEventData*>(ev->data)->param1;
-            midi_data_track->appendEvent(
-                    std::shared_ptr<Event>(new NoteOff(view, midi_data_track, time / 1000,
-                                                       channel, value)));
-
-            if (note_ons[value]){
-              note_ons[value]->setDuration(time / 1000 - note_ons[value]->getTime());
-              note_ons[value] = nullptr;
+        } else if (type == STATUS_NOTE_ON || type == STATUS_NOTE_OFF){
+            decoder.decoded.push_back(Event(EventKind::NoteOff, decoder.tick, time,
+                                            channel, value));
+
+            int note_on = decoder.note_ons[value];
+            if (note_on >= decoder.first_decoded){
+                Event& ev = decoder.decoded[note_on - decoder.first_decoded];
+                ev.duration = std::min<uint64_t>(time - ev.time, UINT32_MAX);
+            } else if (note_on >= 0){
+                //the NoteOn was handed over in an earlier slice
+                uint64_t duration = time - decoder.note_on_times[value];
+                decoder.decoded_durations.push_back(
+                        std::make_pair(note_on, std::min<uint64_t>(duration, UINT32_MAX)));
             }
-        } else if (ev->type == EV_PROGRAM_CHANGE){
-            short channel = static_cast<MIDIChannelEventData*>(ev->data)->channel;
-            short voice = static_cast<MIDIChannelEventData*>(ev->data)->param1;
-            midi_data_track->appendEvent(
-                    std::shared_ptr<Event>(new ProgramChange(view, midi_data_track, time / 1000,
-                                                             channel, voice)));
-        } else if (ev->type == META_TEMPO_CHANGE){
-            conversion = MIDIHeader_getTempoConversion(&new_midi.header, *(uint32_t*)(ev->data));
+            decoder.note_ons[value] = -1;
+        } else if (type == STATUS_PROGRAM_CHANGE){
+            decoder.decoded.push_back(Event(EventKind::ProgramChange, decoder.tick, time,
+                                            channel, value));
         }
-
-        iter = MIDIEventList_next_event(iter);
-        ev = MIDIEventList_get_event(iter);
     }
-
-    MIDIFile_delete(&new_midi);
 }
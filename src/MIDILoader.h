@@ -17,35 +17,100 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string>
+#include <vector>
+#include <cstdint>
 #include <exception>
-#include "libmidi/libmidi.h"
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include "MappedFile.h"
+#include "TempoMap.h"
 
-class Viewport;
+class MIDIData;
 class Track;
 
+//reads standard MIDI files straight out of a memory mapping
 class MIDILoader {
 public:
-    MIDILoader(std::string filename, Viewport* view);
+    //the file is loaded into data, which should be empty
+    MIDILoader(std::string filename, MIDIData* data);
+    //stops any loading still going on in the background
     ~MIDILoader();
 
+    //first stage for every track: builds the tempo map and counts the events.
+    //doesn't touch data, so it can run before taking data's mutex; load() and
+    //start() run it if it hasn't been
+    void prepare();
+    //loads the whole file before returning
     void load();
+    //creates the tracks and starts filling them in on a background thread,
+    //in time order, so the start of the file can be shown and played while
+    //the rest is still being decoded
+    void start();
+    //moves the events decoded so far into the tracks, a batch of slices at a
+    //time so data's mutex is only held briefly; call this regularly from the
+    //UI thread after start(). Returns true once the whole file is in,
+    //rethrows any error the background decoding ran into.
+    bool publish();
+    //whether publish() has more slices to hand over straight away
+    bool hasReady();
+    //fraction of the file decoded so far, from 0 to 1
+    double progress() const;
     void write();
 
-    class LibmidiError : public std::exception {
+    class LoadError : public std::exception {
     public:
-        LibmidiError(std::string error) : error(error) {}
+        LoadError(std::string error) : error(error) {}
         virtual const char* what() const noexcept { return error.c_str(); }
     private:
         std::string error;
     };
 
 private:
-    void loadTrack(Track* midi_data_track, int tracknum);
+    //event data of one MTrk chunk, pointing into the mapped file
+    struct TrackChunk {
+        const uint8_t* data;
+        size_t length;
+    };
+
+    //first stage: collects a track's tempo changes and counts its events
+    void scanTrack(int tracknum, std::vector<TempoMap::TempoChange>& tempo_changes,
+                   int& num_events);
+    //decoding state of one track, kept between slices
+    struct TrackDecoder;
+
+    //creates the tracks in data and their decoders
+    void createTracks();
+    //second stage: decodes a track's events up to time (in us), timed with
+    //the global tempo map
+    void decodeTrack(int tracknum, uint64_t until);
+    //decodes every track in slices of increasing length, handing each
+    //slice over to publish() as it completes
+    void decodeAll();
+    //runs func(tracknum) for every track on the worker pool, larger tracks first;
+    //rethrows the first failure as a LoadError naming the track
+    void forEachTrack(std::function<void(int)> func);
 
     std::string filename;
-    Viewport* view;
-    MIDIFile midi_file;
-    MIDITrack track;
+    MIDIData* data;
+    MappedFile file;
+    int format;
+    uint16_t division;
+    std::vector<TrackChunk> chunks;
+    TempoMap tempo_map;
+    bool prepared;
+    std::vector<int> event_counts;
 
+    std::vector<std::unique_ptr<TrackDecoder>> decoders;
+    std::thread thread;
+    std::atomic<bool> cancelled;
+    std::atomic<size_t> bytes_decoded;
+    size_t total_bytes;
+    //guards the decoders' ready events, done and error
+    std::mutex ready_mutex;
+    bool done;
+    std::exception_ptr error;
 };
 #endif /* MIDILOADER_H */
@@ -20,33 +20,53 @@
 #include <Fl/Fl_Button.H>
 #include <Fl/fl_draw.H>
 #include <Fl/fl_ask.H>
+#include <Fl/Fl_Progress.H>
 #include <cassert>
 #include <sstream>
+#include <algorithm>
 #include "MainWindow.h"
 #include "MIDILoader.h"
 #include "notes_pixmap.h"
 
 #define RES_X 1024
 #define RES_Y 640
+//seconds between moving newly decoded events into the tracks while loading
+#define LOAD_POLL_INTERVAL 0.05
+//seconds after the time label is due to change that it's updated, so it
+//doesn't wake up just short of the next second
+#define LABEL_SLACK 0.002
+#define LABEL_MAX_WAIT 0.25
 
 
 PlaybackControls::PlaybackControls(int x, int y, Viewport* view) :
-                                    Fl_Group(x, y, 140, 80), view(view)
+                                    Fl_Group(x, y, 250, 80), view(view)
 {
     resizable(NULL);
     time_label = new Fl_Box(x + 40, y, 60, 20, "0:0");
     time_label->labelfont(FL_COURIER);
     time_label->labelsize(20);
+    view->setTimeCallback(cbTimeChanged, this);
 
     Fl_Button* rwd = new Fl_Button(x, y + 30, 40, 40, "@<<");
-    rwd->callback(cbRwd, view);
+    rwd->callback(cbRwd, this);
 
     Fl_Button* play = new Fl_Button(x + 50, y + 30, 40, 40, "@>");
-    play->callback(cbPlay, view);
+    play->callback(cbPlay, this);
 
     Fl_Button* fwd = new Fl_Button(x + 100, y + 30, 40, 40, "@>>");
-    fwd->callback(cbRwd, view);
-    Fl::add_timeout(0.001, cbEveryFrame, this);
+    fwd->callback(cbRwd, this);
+
+    Fl_Menu_Item rates[] = {{"0.25x", 0, 0, 0}, {"0.5x", 0, 0, 0},
+                            {"0.75x", 0, 0, 0}, {"1x", 0, 0, 0},
+                            {"1.5x", 0, 0, 0}, {"2x", 0, 0, 0},
+                            {"4x", 0, 0, 0}, { 0}};
+    Fl_Choice* rate = new Fl_Choice(x + 150, y + 35, 55, 30);
+    rate->copy(rates);
+    rate->value(3);
+    rate->callback(cbRate, view);
+
+    Fl_Button* loop = new Fl_Button(x + 210, y + 35, 40, 30, "A-B");
+    loop->callback(cbLoop, view);
 }
 
 void PlaybackControls::resize(int x, int y, int w, int h)
@@ -54,31 +74,32 @@ void PlaybackControls::resize(int x, int y, int w, int h)
     //ignore w and h, prevent widget from being resized
     //otherwise, it gets shrunk with the window and the buttons
     //fall outside the dimensions, so the user can't click them
-    Fl_Group::resize(x, y, 140, 80);
+    Fl_Group::resize(x, y, 250, 80);
 }
 
 void PlaybackControls::cbPlay(Fl_Widget* w, void* v)
 {
     static bool playing = false;
     Fl_Button* play = static_cast<Fl_Button*>(w);
-    Viewport* view = static_cast<Viewport*>(v);
+    PlaybackControls* plybk = static_cast<PlaybackControls*>(v);
 
     if (!playing){
         playing = true;
         play->label("@||");
-        view->getPlayback()->play();
+        plybk->view->getPlayback()->play();
     } else {
         playing = false;
         play->label("@>");
-        view->getPlayback()->pause();
+        plybk->view->getPlayback()->pause();
     }
+    cbTimeChanged(v);
 }
 
 
 void PlaybackControls::cbRwd(Fl_Widget* w, void* v)
 {
-    Viewport* view = static_cast<Viewport*>(v);
-    view->getPlayback()->seek(0);
+    PlaybackControls* plybk = static_cast<PlaybackControls*>(v);
+    plybk->view->getPlayback()->seek(0);
 }
 
 
@@ -86,14 +107,60 @@ void PlaybackControls::cbFwd(Fl_Widget* w, void* v)
 {
 }
 
+void PlaybackControls::cbRate(Fl_Widget* w, void* v)
+{
+    static const double rates[] = { 0.25, 0.5, 0.75, 1.0, 1.5, 2.0, 4.0 };
+    int value = static_cast<Fl_Choice*>(w)->value();
+    Viewport* view = static_cast<Viewport*>(v);
+
+    assert(value >= 0 && value < 7);
+    view->getPlayback()->setRate(rates[value]);
+}
+
+void PlaybackControls::cbLoop(Fl_Widget* w, void* v)
+{
+    static bool marked = false;
+    static uint64_t loop_start = 0;
+    Fl_Button* loop = static_cast<Fl_Button*>(w);
+    Playback* playback = static_cast<Viewport*>(v)->getPlayback();
+
+    if (playback->isLooping()){
+        playback->setLoop(0, 0);
+        loop->label("A-B");
+    } else if (!marked){
+        marked = true;
+        loop_start = playback->getTime();
+        loop->label("B");
+    } else {
+        marked = false;
+        uint64_t loop_end = playback->getTime();
+        if (loop_end < loop_start){
+            std::swap(loop_start, loop_end);
+        }
+        playback->setLoop(loop_start, loop_end);
+        loop->label(playback->isLooping() ? "@reload" : "A-B");
+    }
+}
+
 void PlaybackControls::cbEveryFrame(void* v)
 {
     PlaybackControls* plybk = static_cast<PlaybackControls*>(v);
-    if (plybk->view->getPlayback()->isPlaying()){
-        plybk->time_text = plybk->view->getPlayback()->getTimeString();
-        plybk->time_label->label(plybk->time_text.c_str());
+    Playback* playback = plybk->view->getPlayback();
+    plybk->time_text = playback->getTimeString();
+    plybk->time_label->label(plybk->time_text.c_str());
+    //the label only shows whole seconds, so wake up as the next one starts,
+    //or a little sooner to catch seeks and the loop jumping back
+    if (playback->isPlaying()){
+        uint64_t until_next = 1000000 - playback->getTime() % 1000000;
+        double wait = until_next / playback->getRate() / 1000000.0 + LABEL_SLACK;
+        Fl::add_timeout(std::min(wait, LABEL_MAX_WAIT), PlaybackControls::cbEveryFrame, v);
     }
-    Fl::repeat_timeout(0.001, PlaybackControls::cbEveryFrame, v);
+}
+
+void PlaybackControls::cbTimeChanged(void* v)
+{
+    Fl::remove_timeout(cbEveryFrame, v);
+    cbEveryFrame(v);
 }
 
 EditControls::EditControls(int x, int y, Viewport *view) :
@@ -158,6 +225,7 @@ MainWindow::MainWindow() : Fl_Double_Window(RES_X, RES_Y)
 
     Fl_Menu_Item items[] = { { "&File", 0, 0, 0, FL_SUBMENU},
                            { "&Open MIDI", FL_COMMAND + 'o', cbOpenMIDIFile, this},
+                           { "&Render Audio", FL_COMMAND + 'r', cbRender, this},
                            { "&Quit", FL_COMMAND + 'q', cbQuit, this},
                            { 0 },
                            { "&Edit", 0, 0, 0, FL_SUBMENU},
@@ -176,25 +244,53 @@ MainWindow::MainWindow() : Fl_Double_Window(RES_X, RES_Y)
 
     editctl = new EditControls(RES_X / 2 - 270, RES_Y - 80, view);
     editctl->end();
+
+    load_progress = new Fl_Progress(RES_X - 210, RES_Y - 65, 200, 20);
+    load_progress->minimum(0.0);
+    load_progress->maximum(1.0);
+    load_progress->hide();
+    //closing the window has to stop any background loading too
+    callback(cbQuit, this);
     midi_chooser.type(Fl_Native_File_Chooser::BROWSE_FILE);
     midi_chooser.title("Choose MIDI file");
     midi_chooser.filter("MIDI Files\t*.mid");
+    render_chooser.type(Fl_Native_File_Chooser::BROWSE_SAVE_FILE);
+    render_chooser.options(Fl_Native_File_Chooser::SAVEAS_CONFIRM);
+    render_chooser.title("Render audio to");
+#ifdef HAVE_SNDFILE
+    render_chooser.filter("WAV Files\t*.wav\nFLAC Files\t*.flac");
+#else
+    render_chooser.filter("WAV Files\t*.wav");
+#endif
 }
 
 void MainWindow::quit()
 {
+    Fl::remove_timeout(cbLoadProgress, this);
+    Fl::remove_timeout(cbCacheSaved, this);
+    Fl::remove_timeout(cbRenderProgress, this);
+    loader.reset();
+    cache.reset();
+    renderer.reset();
     about_dialog->hide();
     settings_dialog->hide();
     hide();
 }
 
 
+Viewport* MainWindow::getViewport()
+{
+    return view;
+}
+
+
 void MainWindow::resize(int x, int y, int w, int h)
 {
     Fl_Double_Window::resize(x, y, w, h);
     //keep the playback controls centred
     controls->position(w / 2 - 70, controls->y());
     editctl->position(w / 2 - 270, editctl->y());
+    load_progress->resize(w - 210, load_progress->y(), 200, 20);
 }
 
 
@@ -213,7 +309,7 @@ void MainWindow::cbSettings(Fl_Widget* w, void* v)
 void MainWindow::cbOpenMIDIFile(Fl_Widget* w, void* v)
 {
     MainWindow* mw = static_cast<MainWindow*>(v);
-    Track* trk = mw->view->getMIDIData()->getTrack(0);
+    MIDIData* data = mw->view->getMIDIData();
 
     switch (mw->midi_chooser.show()){
         case -1:
@@ -223,16 +319,60 @@ void MainWindow::cbOpenMIDIFile(Fl_Widget* w, void* v)
 	    return;
     }
     try {
-        mw->view->getMIDIData()->clear();
+        //stop loading the previous file if it's still going, and writing
+        //its cache, which reads the tracks about to be cleared
+        Fl::remove_timeout(cbLoadProgress, mw);
+        Fl::remove_timeout(cbCacheSaved, mw);
+        mw->loader.reset();
+        mw->cache.reset();
+        mw->load_progress->hide();
+
+        //load midi file, from the cache of a previous parse if there is one,
+        //otherwise scan it. both read the whole file, so do it before taking
+        //the lock, the old file keeps playing meanwhile
+        std::string filename(mw->midi_chooser.filename());
+        std::unique_ptr<MIDICache> cache(new MIDICache(filename));
+        std::unique_ptr<MIDILoader> loader;
+        MIDIData cached;
+        if (!cache->load(&cached)){
+            loader.reset(new MIDILoader(filename, data));
+            loader->prepare();
+        }
+
+        std::lock_guard<std::mutex> lk(data->getMutex());
+        data->clear();
+        if (loader){
+            //decode it in the background, the start of the file can be
+            //played as soon as it's in
+            loader->start();
+            data->setLoading(true);
+            mw->loader = std::move(loader);
+            mw->load_progress->value(0.0);
+            mw->load_progress->show();
+            Fl::add_timeout(LOAD_POLL_INTERVAL, cbLoadProgress, mw);
+        } else {
+            data->swap(cached);
+        }
+        mw->cache = std::move(cache);
         mw->view->getPlayback()->seek(0);
-        //load midi file
-        MIDILoader loader(std::string(mw->midi_chooser.filename()),
-                          mw->view);
-        loader.load();
 
-        mw->title = "MiniMIDI -- " + std::string(mw->midi_chooser.filename());
+        mw->title = "MiniMIDI -- " + filename;
         mw->label(mw->title.c_str());
     } catch (std::exception &e){
+        mw->loader.reset();
+        {
+            //the old file is kept if the new one failed before it was
+            //cleared, otherwise start over with an empty one
+            std::lock_guard<std::mutex> lk(data->getMutex());
+            if (data->numTracks() == 0){
+                data->newTrack();
+                mw->title = "MiniMIDI";
+                mw->label(mw->title.c_str());
+            }
+            //the old file may have been cut short by cancelling its loader
+            data->setLoading(false);
+            mw->view->getPlayback()->seek(0);
+        }
         fl_alert(e.what());
     }
     //update the editor controls with new file's info
@@ -240,6 +380,101 @@ void MainWindow::cbOpenMIDIFile(Fl_Widget* w, void* v)
     mw->view->redraw();
 }
 
+void MainWindow::cbLoadProgress(void* v)
+{
+    MainWindow* mw = static_cast<MainWindow*>(v);
+    bool done;
+    bool failed = false;
+
+    try {
+        done = mw->loader->publish();
+        mw->view->getPlayback()->tracksChanged();
+    } catch (std::exception &e){
+        //keep whatever was loaded before the error
+        done = true;
+        failed = true;
+        fl_alert(e.what());
+    }
+    mw->load_progress->value(mw->loader->progress());
+    mw->view->redrawEditor();
+
+    if (!done){
+        //come straight back for a backlog, letting the UI run in between
+        Fl::repeat_timeout(mw->loader->hasReady() ? 0.0 : LOAD_POLL_INTERVAL, cbLoadProgress, v);
+        return;
+    }
+    mw->loader.reset();
+    if (!failed){
+        //writing a large file's cache takes a while, so it's done in the
+        //background with the tracks still locked against editing
+        mw->cache->start(mw->view->getMIDIData());
+        Fl::add_timeout(LOAD_POLL_INTERVAL, cbCacheSaved, v);
+        return;
+    }
+    mw->view->getMIDIData()->setLoading(false);
+    mw->load_progress->hide();
+}
+
+void MainWindow::cbCacheSaved(void* v)
+{
+    MainWindow* mw = static_cast<MainWindow*>(v);
+    if (!mw->cache->finished()){
+        Fl::repeat_timeout(LOAD_POLL_INTERVAL, cbCacheSaved, v);
+        return;
+    }
+    mw->view->getMIDIData()->setLoading(false);
+    mw->load_progress->hide();
+}
+
+void MainWindow::cbRender(Fl_Widget* w, void* v)
+{
+    MainWindow* mw = static_cast<MainWindow*>(v);
+
+    //both show their progress in the same place
+    if (mw->view->getMIDIData()->isLoading() || mw->renderer){
+        fl_alert("Wait for the file to finish loading or rendering first.");
+        return;
+    }
+    switch (mw->render_chooser.show()){
+        case -1:
+            fl_alert(mw->render_chooser.errmsg());
+            return;
+        case 1: //user cancelled
+            return;
+    }
+    std::string filename(mw->render_chooser.filename());
+    if (filename.find('.', filename.find_last_of("/\\") + 1) == std::string::npos){
+        filename += mw->render_chooser.filter_value() == 1 ? ".flac" : ".wav";
+    }
+    mw->renderer.reset(new Renderer(mw->view->getMIDIData(),
+                                    mw->view->getPlayback()->getSynth()->getSF()));
+    mw->renderer->start(filename);
+    mw->load_progress->value(0.0);
+    mw->load_progress->show();
+    Fl::add_timeout(LOAD_POLL_INTERVAL, cbRenderProgress, mw);
+}
+
+void MainWindow::cbRenderProgress(void* v)
+{
+    MainWindow* mw = static_cast<MainWindow*>(v);
+    bool done;
+
+    try {
+        done = mw->renderer->finished();
+    } catch (std::exception &e){
+        done = true;
+        fl_alert(e.what());
+    }
+    mw->load_progress->value(mw->renderer->progress());
+
+    if (!done){
+        Fl::repeat_timeout(LOAD_POLL_INTERVAL, cbRenderProgress, v);
+        return;
+    }
+    mw->renderer.reset();
+    mw->load_progress->hide();
+}
+
 void MainWindow::cbQuit(Fl_Widget* w, void* v)
 {
     static_cast<MainWindow*>(v)->quit();
@@ -17,14 +17,19 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <string>
+#include <memory>
 #include <Fl/Fl_Double_Window.H>
 #include <Fl/Fl_Native_File_Chooser.H>
 #include "Viewport.h"
 #include "AboutDialog.h"
 #include "SettingsDialog.h"
+#include "MIDILoader.h"
+#include "MIDICache.h"
+#include "Renderer.h"
 
 class Fl_Box;
 class Fl_Menu_Bar;
+class Fl_Progress;
 
 class PlaybackControls : public Fl_Group {
 public:
@@ -39,7 +44,13 @@ private:
     static void cbPlay(Fl_Widget* w, void* v);
     static void cbRwd(Fl_Widget* w, void* v);
     static void cbFwd(Fl_Widget* w, void* v);
+    static void cbRate(Fl_Widget* w, void* v);
+    //first press marks the start of the loop, the second its end, the
+    //third clears it
+    static void cbLoop(Fl_Widget* w, void* v);
     static void cbEveryFrame(void* v);
+    //shows the new time straight away after any seek, even while paused
+    static void cbTimeChanged(void* v);
 };
 
 class EditControls : public Fl_Group {
@@ -62,22 +73,37 @@ public:
     MainWindow();
     void quit(); //closes all child windows before quitting
     virtual void resize(int x, int y, int w, int h);
+    Viewport* getViewport();
 
     //v pointer to the MainWindow
     static void cbAbout(Fl_Widget* w, void* v);
     static void cbSettings(Fl_Widget* w, void* v);
     static void cbOpenMIDIFile(Fl_Widget* w, void* v);
+    static void cbRender(Fl_Widget* w, void* v);
     static void cbQuit(Fl_Widget* w, void* v);
+    //publishes what the loader decoded since the last call, until it's done
+    static void cbLoadProgress(void* v);
+    //ends loading once the cache has been written in the background
+    static void cbCacheSaved(void* v);
+    //shows how far the renderer is, until it's done
+    static void cbRenderProgress(void* v);
 
 private:
     Fl_Menu_Bar* menu;
     Viewport* view;
     PlaybackControls* controls;
     EditControls* editctl;
+    Fl_Progress* load_progress;
     AboutDialog* about_dialog;
     SettingsDialog* settings_dialog;
     Fl_Native_File_Chooser midi_chooser; //statically alloc'd since it's not a widget
+    Fl_Native_File_Chooser render_chooser;
     std::string title;
+    //file being loaded in the background, and its cache to write once it's done
+    std::unique_ptr<MIDILoader> loader;
+    std::unique_ptr<MIDICache> cache;
+    //song being rendered to an audio file in the background
+    std::unique_ptr<Renderer> renderer;
 };
 
 #endif
@@ -0,0 +1,109 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include "MappedFile.h"
+
+//empty files can't be mapped, they get a pointer to this instead
+static const uint8_t empty_file[1] = { 0 };
+
+#ifdef _WIN32
+MappedFile::MappedFile(std::string filename)
+                       : bytes(empty_file), length(0), file_handle(INVALID_HANDLE_VALUE),
+                         mapping_handle(NULL)
+{
+    file_handle = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file_handle == INVALID_HANDLE_VALUE) {
+        throw MapError();
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_handle, &size)) {
+        CloseHandle(file_handle);
+        throw MapError();
+    }
+    length = static_cast<size_t>(size.QuadPart);
+    if (length == 0) {
+        return;
+    }
+
+    mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!mapping_handle) {
+        CloseHandle(file_handle);
+        throw MapError();
+    }
+    bytes = static_cast<const uint8_t*>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+    if (!bytes) {
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        throw MapError();
+    }
+}
+
+MappedFile::~MappedFile()
+{
+    if (length > 0) {
+        UnmapViewOfFile(bytes);
+        CloseHandle(mapping_handle);
+    }
+    CloseHandle(file_handle);
+}
+#else
+MappedFile::MappedFile(std::string filename) : bytes(empty_file), length(0)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw MapError();
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw MapError();
+    }
+    length = st.st_size;
+    if (length == 0) {
+        close(fd);
+        return;
+    }
+
+    void* addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    //the mapping keeps its own reference to the file
+    close(fd);
+    if (addr == MAP_FAILED) {
+        length = 0;
+        throw MapError();
+    }
+    //tracks are decoded front to back
+    madvise(addr, length, MADV_SEQUENTIAL);
+    bytes = static_cast<const uint8_t*>(addr);
+}
+
+MappedFile::~MappedFile()
+{
+    if (length > 0) {
+        munmap(const_cast<uint8_t*>(bytes), length);
+    }
+}
+#endif
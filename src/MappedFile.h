@@ -0,0 +1,54 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+
+//read-only memory mapping of a whole file, unmapped on destruction
+class MappedFile {
+public:
+    MappedFile(std::string filename);
+    ~MappedFile();
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+    class MapError : public std::exception {
+    public:
+        virtual const char* what() const noexcept
+        {
+            return "Failed to open file!";
+        }
+    };
+
+private:
+    //not copyable, the mapping is released in the destructor
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const uint8_t* bytes;
+    size_t length;
+#ifdef _WIN32
+    void* file_handle;
+    void* mapping_handle;
+#endif
+};
+
+#endif /* MAPPEDFILE_H */
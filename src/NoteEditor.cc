@@ -15,9 +15,11 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <memory>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
 #include <Fl/fl_draw.H>
+#include <Fl/x.H>
 #include <Fl/Fl_Scrollbar.H>
 #include <Fl/Fl_Slider.H>
 #include "NoteEditor.h"
@@ -27,10 +29,26 @@
 #define BAROFFSET 300
 #define SCROLLWIDTH 20
 #define SEEKERHEIGHT 20
+//width of the note names on the left of the background, which stay put
+//while the notes scroll across them
+#define NAMEWIDTH 20
+//zoom limits
+#define MIN_MS_PER_PIXEL 1
+#define MAX_MS_PER_PIXEL 8192
+
+//whether each note of the octave, starting from C, is a black key
+static constexpr bool BLACK_KEYS[12] = {
+    false, true, false, true, false, false, true, false, true, false, true, false
+};
 
 NoteEditor::NoteEditor(int x, int y, int w, int h, Viewport* view) : x(x), y(y), w(w), h(h),
-                       view(view), note_thickness(10), ms_per_pixel(10), track_num(0)
+                       view(view), note_thickness(10), ms_per_pixel(10), track_num(0),
+                       drag_note(-1), background(0), background_w(0), background_h(0),
+                       background_note(-1), background_thickness(0), front_frame(0),
+                       frame_origin(0), frame_ms_per_pixel(0)
 {
+    frames[0] = frames[1] = 0;
+    updateNoteTops();
     scroll_vert = new Fl_Scrollbar(x + w - SCROLLWIDTH - 2, y + 1, SCROLLWIDTH, h - 2);
     scroll_vert->value(40, 30, 0, 127);
     scroll_vert->linesize(2);
@@ -41,43 +59,53 @@ NoteEditor::NoteEditor(int x, int y, int w, int h, Viewport* view) : x(x), y(y),
     seeker->callback(cbSeeker, view);
 }
 
-void NoteEditor::draw() const
+NoteEditor::~NoteEditor()
 {
-    int line_y = 0;
-    int start_note = scroll_vert->value();
+    if (background){
+        fl_delete_offscreen(background);
+        fl_delete_offscreen(frames[0]);
+        fl_delete_offscreen(frames[1]);
+    }
+}
 
+void NoteEditor::draw(bool scrolled) const
+{
     fl_push_clip(x, y, w, h);
-    fl_rectf(x, y, w, h, 0, 0, 0);
-    fl_color(150, 150, 150);
-
-    //draw the grey lines separating the notes
-    for (int i = start_note; i <= 127; i++){
-        if (i % 12 == 1 || i % 12 == 3 || i % 12 == 6 || i % 12 == 8 || i % 12 == 10){
-            fl_line(x, y + line_y, x + w, y + line_y);
-            line_y += note_thickness;
-        } else {
-            fl_line(x, y + line_y, x + w, y + line_y);
-            line_y += note_thickness + 4;
+    bool background_changed = updateBackground();
+    //notes are placed by whole columns from the start of the song, so a
+    //column looks the same whichever frame it was drawn in
+    int64_t origin = view->getPlayback()->getTime() / (ms_per_pixel * 1000);
+    int64_t shift = origin - frame_origin;
+
+    if (scrolled && !background_changed && frame_ms_per_pixel == ms_per_pixel
+        && shift >= 0 && shift < w - NAMEWIDTH){
+        if (shift > 0){
+            scrollFrame(origin, shift);
         }
-        drawNoteName(i, x + 4, y + line_y - 1);
-        fl_color(150, 150, 150);
+    } else {
+        fl_begin_offscreen(frames[front_frame]);
+        fl_copy_offscreen(0, 0, w, h, background, 0, 0);
+        drawNotes(origin, 0, w);
+        fl_end_offscreen();
     }
+    frame_origin = origin;
+    frame_ms_per_pixel = ms_per_pixel;
+    fl_copy_offscreen(x, y, w, h, frames[front_frame], 0, 0);
 
-    drawNotes();
     fl_color(0, 50, 200);
     fl_line(x + BAROFFSET, y, x + BAROFFSET, y + h);
     scroll_vert->redraw();
 
-    //update seeker value and range as necessary
-    int dur = 0;
+    //update seeker value and range as necessary, the seeker works in ms
+    uint64_t dur = 0;
     int num_tracks = view->getMIDIData()->numTracks();
     for (int i = 0; i < num_tracks; i++){
         if (view->getMIDIData()->getTrack(i)->getDuration() > dur){
             dur = view->getMIDIData()->getTrack(i)->getDuration();
         }
     }
-    seeker->range(0.0, static_cast<double>(dur));
-    seeker->value(view->getPlayback()->getTime());
+    seeker->range(0.0, static_cast<double>(dur / 1000));
+    seeker->value(static_cast<double>(view->getPlayback()->getTime() / 1000));
     seeker->redraw();
 
     fl_pop_clip();
@@ -99,56 +127,81 @@ void NoteEditor::resize(int w, int h)
 
 void NoteEditor::mouseDown(int mouse_x, int mouse_y)
 {
-    long time = getMsPerPixel() * (mouse_x - x - BAROFFSET) + static_cast<signed long>(view->getPlayback()->getTime());
-    drag_note.reset(new NoteOn(view, view->getMIDIData()->getTrack(track_num), time, 0, noteFromPos(mouse_y), 100, 20));
-    if (time > 0){
-        view->getMIDIData()->getTrack(track_num)->addEvent(drag_note);
+    int64_t time = timeFromPos(mouse_x);
+    int value = noteFromPos(mouse_y);
+    if (time > 0 && value >= 0 && value <= 127){
+        Event ev = makeEvent(EventKind::NoteOn, time, value, 100);
+        ev.duration = 20000;
+        {
+            std::lock_guard<std::mutex> lk(view->getMIDIData()->getMutex());
+            drag_note = view->getMIDIData()->getTrack(track_num)->addEvent(ev);
+        }
+        view->getPlayback()->tracksChanged();
+        view->redrawEditor();
     }
 }
 
 void NoteEditor::mouseDrag(int mouse_x, int mouse_y)
 {
-    long time = getMsPerPixel() * (mouse_x - x - BAROFFSET) + static_cast<signed long>(view->getPlayback()->getTime());
-    long start_time = drag_note->getTime();
-    if (time < start_time) time = 0;
-    drag_note->setDuration(time - start_time);
-    view->redraw();
+    //the length stays put while the mouse is off the notes
+    int value = noteFromPos(mouse_y);
+    if (drag_note < 0 || value < 0 || value > 127){
+        return;
+    }
+    Track* track = view->getMIDIData()->getTrack(track_num);
+    int64_t time = timeFromPos(mouse_x);
+    int64_t start_time = track->getTime(drag_note);
+    if (time < start_time) time = start_time;
+    std::lock_guard<std::mutex> lk(view->getMIDIData()->getMutex());
+    track->setNoteDuration(drag_note, time - start_time);
+    view->redrawEditor();
 }
 
 void NoteEditor::mouseRelease(int mouse_x, int mouse_y)
 {
-    if (drag_note){
-        long time = getMsPerPixel() *  (mouse_x - x - BAROFFSET) + static_cast<signed long>(view->getPlayback()->getTime());
-        std::shared_ptr<Event> ev(new NoteOff(view, view->getMIDIData()->getTrack(track_num), time, 0, static_cast<NoteOn*>(drag_note.get())->getValue()));
-        if (time > drag_note->getTime() + 10){
-            view->getMIDIData()->getTrack(track_num)->addEvent(ev);
-        } else {
-            //user tried to drag left of note start; invalid, so we remove the NoteOn added earlier
-            view->getMIDIData()->getTrack(track_num)->removeEvent(drag_note);
+    if (drag_note >= 0){
+        Track* track = view->getMIDIData()->getTrack(track_num);
+        int64_t time = timeFromPos(mouse_x);
+        {
+            std::lock_guard<std::mutex> lk(view->getMIDIData()->getMutex());
+            if (time > static_cast<int64_t>(track->getTime(drag_note)) + 10000){
+                track->addEvent(makeEvent(EventKind::NoteOff, time, track->getValue(drag_note)));
+            } else {
+                //user tried to drag left of note start; invalid, so we remove the NoteOn added earlier
+                track->removeEvent(drag_note);
+            }
         }
-        drag_note.reset();
+        view->getPlayback()->tracksChanged();
+        view->redrawEditor();
+        drag_note = -1;
     }
 }
 
 void NoteEditor::rightRelease(int mouse_x, int mouse_y)
 {
-    long time = getMsPerPixel() * (mouse_x - x - BAROFFSET) + static_cast<signed long>(view->getPlayback()->getTime());
+    int64_t time = timeFromPos(mouse_x);
     int value = noteFromPos(mouse_y);
-    if (time > 0){
-        view->getMIDIData()->getTrack(track_num)->removeNotesAt(time, value);
+    if (time > 0 && value >= 0 && value <= 127){
+        {
+            std::lock_guard<std::mutex> lk(view->getMIDIData()->getMutex());
+            view->getMIDIData()->getTrack(track_num)->removeNotesAt(time, value);
+        }
+        view->getPlayback()->tracksChanged();
     }
-    view->redraw();
+    view->redrawEditor();
 }
 
 void NoteEditor::setThickness(int thickness)
 {
     note_thickness = thickness;
-    view->redraw();
+    updateNoteTops();
+    view->redrawEditor();
 }
 
 void NoteEditor::setMsPerPixel(int ms)
 {
-    ms_per_pixel = ms;
+    ms_per_pixel = std::min(std::max(ms, MIN_MS_PER_PIXEL), MAX_MS_PER_PIXEL);
+    view->redrawEditor();
 }
 
 int NoteEditor::getMsPerPixel() const
@@ -156,32 +209,23 @@ int NoteEditor::getMsPerPixel() const
     return ms_per_pixel;
 }
 
-void NoteEditor::getNotePos(int note_value, unsigned long time, int &x, int &y) const
+void NoteEditor::getNotePos(int note_value, uint64_t time, int &x, int &y) const
 {
     int start_note = scroll_vert->value();
-    x = this->x + ((signed long)time - (signed long)view->getPlayback()->getTime()) / ms_per_pixel + 300;
+    int64_t us_per_pixel = ms_per_pixel * 1000;
+    x = this->x + static_cast<int64_t>(time / us_per_pixel)
+        - static_cast<int64_t>(view->getPlayback()->getTime() / us_per_pixel) + BAROFFSET;
 
     if (note_value < start_note){
         y = this->y - 20; //outside clip area, so invisible
         return;
     }
-    y = this->y;
-    for (int i = start_note; i < note_value; i++) {
-        if (isBlackNote(i)) {
-            y += note_thickness;
-        } else {
-            y += note_thickness + 4;
-        }
-    }
+    y = this->y + note_tops[note_value] - note_tops[start_note];
 }
 
 int NoteEditor::getNoteThickness(int note_value) const
 {
-    if (isBlackNote(note_value)){
-        return note_thickness;
-    } else {
-        return note_thickness + 4;
-    }
+    return note_tops[note_value + 1] - note_tops[note_value];
 }
 
 void NoteEditor::setTrack(int track_num)
@@ -194,46 +238,136 @@ void NoteEditor::cbSeeker(Fl_Widget* w, void* v)
     Fl_Slider* seeker = static_cast<Fl_Slider*>(w);
     Viewport* view = static_cast<Viewport*>(v);
 
-    view->getPlayback()->seek(static_cast<unsigned long>(seeker->value()));
+    view->getPlayback()->seek(static_cast<uint64_t>(seeker->value()) * 1000);
 }
 
 void NoteEditor::cbScroll(Fl_Widget* w, void* v)
 {
-    static_cast<Viewport*>(v)->redraw();
+    static_cast<Viewport*>(v)->redrawEditor();
+}
+
+bool NoteEditor::isBlackNote(int i)
+{
+    return BLACK_KEYS[i % 12];
+}
+
+void NoteEditor::updateNoteTops()
+{
+    note_tops[0] = 0;
+    for (int i = 0; i < 128; i++){
+        note_tops[i + 1] = note_tops[i] + (isBlackNote(i) ? note_thickness : note_thickness + 4);
+    }
 }
 
-bool NoteEditor::isBlackNote(int i) const
+bool NoteEditor::updateBackground() const
 {
-    return (i % 12 == 1 || i % 12 == 3 || i % 12 == 6 || i % 12 == 8 || i % 12 == 10);
+    int start_note = scroll_vert->value();
+    if (background && background_w == w && background_h == h
+        && background_note == start_note && background_thickness == note_thickness){
+        return false;
+    }
+    if (background && (background_w != w || background_h != h)){
+        fl_delete_offscreen(background);
+        fl_delete_offscreen(frames[0]);
+        fl_delete_offscreen(frames[1]);
+        background = 0;
+    }
+    if (!background){
+        background = fl_create_offscreen(w, h);
+        frames[0] = fl_create_offscreen(w, h);
+        frames[1] = fl_create_offscreen(w, h);
+    }
+    background_w = w;
+    background_h = h;
+    background_note = start_note;
+    background_thickness = note_thickness;
+
+    fl_begin_offscreen(background);
+    drawBackground(0, 0);
+    fl_end_offscreen();
+    return true;
 }
 
-void NoteEditor::drawNotes() const
+void NoteEditor::drawBackground(int x, int y) const
 {
-    long draw_from = view->getPlayback()->getTime() - BAROFFSET * ms_per_pixel;
+    int line_y = 0;
+    int start_note = scroll_vert->value();
+
+    fl_rectf(x, y, w, h, 0, 0, 0);
+    fl_color(150, 150, 150);
+
+    //draw the grey lines separating the notes
+    for (int i = start_note; i <= 127; i++){
+        fl_line(x, y + line_y, x + w, y + line_y);
+        line_y += getNoteThickness(i);
+        drawNoteName(i, x + 4, y + line_y - 1);
+        fl_color(150, 150, 150);
+    }
+}
+
+void NoteEditor::drawNotes(int64_t origin, int from, int to) const
+{
+    int64_t us_per_pixel = ms_per_pixel * 1000;
+    int64_t draw_from = (origin + from - BAROFFSET) * us_per_pixel;
+    int64_t draw_to = (origin + to - BAROFFSET) * us_per_pixel;
+    if (draw_to < 0){
+        return;
+    }
+    if (draw_from < 0){
+        draw_from = 0;
+    }
+    int start_note = scroll_vert->value();
     int num_tracks = view->getMIDIData()->numTracks();
-    int num_events;
     Track* track;
     char r, g, b;
 
+    fl_push_clip(from, 0, to - from, h);
     for (int i = 0; i < num_tracks; i++){
         track = view->getMIDIData()->getTrack(i);
-        num_events = track->numEvents();
         track->getColour(r, g, b);
         fl_color(r, g, b);
 
-        for (int idx = 0; idx < num_events; idx++){
-            //stop when when the notes are off-screen
-            if ((signed long)(track->getEvent(idx)->getTime()) >
-                   draw_from + this->w * ms_per_pixel){
-                break;
-            }
-            if ((signed long)(track->getEvent(idx)->getTime()) >= draw_from ||
-                    (signed long)(track->getEvent(idx)->getTime()) +
-                    track->getEvent(idx)->getDuration() >= draw_from){
-                track->getEvent(idx)->draw();
+        //zoomed out on a dense track, draw runs of notes instead of each one,
+        //at least a column wide so they don't vanish
+        bool summarized = track->forNoteSpansIn(draw_from, draw_to, us_per_pixel,
+                                                [&](int value, uint64_t start, uint64_t end) {
+            if (value >= start_note){
+                int64_t x = static_cast<int64_t>(start / us_per_pixel) - origin + BAROFFSET;
+                int64_t width = static_cast<int64_t>(end / us_per_pixel - start / us_per_pixel);
+                int y = note_tops[value] - note_tops[start_note];
+                fl_rectf(x, y + 1, std::max<int64_t>(width, 1), getNoteThickness(value) - 1);
             }
+            return true;
+        });
+        if (summarized){
+            continue;
         }
+        track->forNotesIn(draw_from, draw_to, [&](int idx) {
+            int value = track->getValue(idx);
+            if (value >= start_note){
+                int64_t x = static_cast<int64_t>(track->getTime(idx) / us_per_pixel)
+                            - origin + BAROFFSET;
+                int y = note_tops[value] - note_tops[start_note];
+                fl_rectf(x, y + 1, track->getNoteDuration(idx) / us_per_pixel,
+                         getNoteThickness(value) - 1);
+            }
+            return true;
+        });
     }
+    fl_pop_clip();
+}
+
+void NoteEditor::scrollFrame(int64_t origin, int shift) const
+{
+    int back = 1 - front_frame;
+    fl_begin_offscreen(frames[back]);
+    fl_copy_offscreen(0, 0, w - shift, h, frames[front_frame], shift, 0);
+    fl_copy_offscreen(w - shift, 0, shift, h, background, w - shift, 0);
+    drawNotes(origin, w - shift, w);
+    fl_copy_offscreen(0, 0, NAMEWIDTH, h, background, 0, 0);
+    drawNotes(origin, 0, NAMEWIDTH);
+    fl_end_offscreen();
+    front_frame = back;
 }
 
 void NoteEditor::drawNoteName(int note, int x, int y) const
@@ -274,19 +408,32 @@ void NoteEditor::drawNoteName(int note, int x, int y) const
     }
 }
 
-int NoteEditor::noteFromPos(int pos_y) const
+int64_t NoteEditor::timeFromPos(int pos_x) const
 {
-    int px = y;
-    for (int note = scroll_vert->value(); note <= 127; note++){
-        if (isBlackNote(note)){
-            px += note_thickness;
-        } else {
-            px += note_thickness + 4;
-        }
+    return static_cast<int64_t>(ms_per_pixel) * 1000 * (pos_x - x - BAROFFSET)
+           + static_cast<int64_t>(view->getPlayback()->getTime());
+}
 
-        if (pos_y <= px){
-            return note;
-        }
+Event NoteEditor::makeEvent(EventKind kind, int64_t time, short value, short velocity) const
+{
+    //events sit on whole ticks, so the time is snapped to the tick before it
+    const TempoMap& tempo_map = view->getMIDIData()->getTempoMap();
+    uint64_t tick = tempo_map.microsToTick(time);
+    return Event(kind, tick, tempo_map.tickToMicros(tick), 0, value, velocity);
+}
+
+int NoteEditor::noteFromPos(int pos_y) const
+{
+    //the keyboard and anything else outside the editor has no note
+    if (pos_y < y || pos_y >= y + h){
+        return -1;
+    }
+    //first note whose bottom is at or below pos_y
+    int start_note = scroll_vert->value();
+    int offset = pos_y - y + note_tops[start_note];
+    const int* bottom = std::lower_bound(note_tops + start_note + 1, note_tops + 129, offset);
+    if (bottom == note_tops + 129){
+        return -1;
     }
-    return -1;
+    return bottom - note_tops - 1;
 }
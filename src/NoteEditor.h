@@ -17,18 +17,24 @@
 #ifndef NOTEEDITOR_H
 #define NOTEEDITOR_H
 #include <memory>
+#include <cstdint>
+#include <Fl/x.H>
+#include "MIDI.h"
 
 class Viewport;
 class Fl_Widget;
 class Fl_Scrollbar;
 class Fl_Slider;
-class Event;
 
 class NoteEditor {
 public:
     NoteEditor(int x, int y, int w, int h, Viewport* view);
+    ~NoteEditor();
 
-    void draw() const;
+    //with scrolled set, only the playback time has moved since the last
+    //draw, so the previous frame is shifted across and just the newly
+    //exposed strip drawn
+    void draw(bool scrolled = false) const;
     void move(int x, int y);
     void resize(int w, int h);
 
@@ -43,8 +49,8 @@ public:
     //sets the number of milliseconds per pixel
     void setMsPerPixel(int ms);
     int getMsPerPixel() const;
-    //returns absolute y position of this note on the NoteEditor
-    void getNotePos(int note_value, unsigned long time, int &x, int &y) const;
+    //returns absolute position of this note on the NoteEditor, time is in us
+    void getNotePos(int note_value, uint64_t time, int &x, int &y) const;
     //returns the thickness of this note
     int getNoteThickness(int note_value) const;
     //set which track we are editing
@@ -55,21 +61,60 @@ public:
     static void cbScroll(Fl_Widget* w, void* data);
 
 private:
-    bool isBlackNote(int note_value) const;
-    void drawNotes() const;
+    static bool isBlackNote(int note_value);
+    //fills note_tops for the current note_thickness
+    void updateNoteTops();
+    //redraws the background offscreen if the scroll position, note
+    //thickness or size changed since it was last drawn, returns whether it did
+    bool updateBackground() const;
+    //draws the lines separating the notes and their names, with the top
+    //left corner at x, y
+    void drawBackground(int x, int y) const;
+    //draws the notes between columns from and to (relative to the left of
+    //the editor) into an offscreen, with the playback time at column
+    //origin + BAROFFSET counting columns from the start of the song
+    void drawNotes(int64_t origin, int from, int to) const;
+    //shifts the current frame left by shift columns into the other frame
+    //offscreen and fills in what's missing
+    void scrollFrame(int64_t origin, int shift) const;
     void drawNoteName(int note, int x, int y) const;
-    //get the MIDI note value of the note at this y value
+    //get the MIDI note value of the note at this y value, or -1 if there's
+    //no note there
     int noteFromPos(int pos_y) const;
+    //get the song time in us at this x value
+    int64_t timeFromPos(int pos_x) const;
+    //event on channel 0 at the tick nearest before time
+    Event makeEvent(EventKind kind, int64_t time, short value, short velocity = 0) const;
 
     int x, y, w, h;
     Viewport* view;
     Fl_Scrollbar* scroll_vert;
     Fl_Slider* seeker;
     int note_thickness;
+    //y of the top of each note counted from the top of note 0, with
+    //note_tops[128] the bottom of note 127, so a note's thickness is the
+    //difference between its entry and the next
+    int note_tops[129];
     int ms_per_pixel;
     int track_num;
 
-    std::shared_ptr<Event> drag_note;
+    //index of the NoteOn being drawn with the mouse in the current track, or -1
+    int drag_note;
+
+    //the background as last drawn, copied in on every frame instead of
+    //drawing all the lines and note names again; 0 until first drawn
+    mutable Fl_Offscreen background;
+    //what the background was drawn for
+    mutable int background_w, background_h;
+    mutable int background_note;
+    mutable int background_thickness;
+    //the last frame drawn without the bar, and the one the next frame is
+    //scrolled into, since an offscreen can't be copied onto itself
+    mutable Fl_Offscreen frames[2];
+    mutable int front_frame;
+    //column the last frame was drawn at, in columns from the start of the song
+    mutable int64_t frame_origin;
+    mutable int frame_ms_per_pixel;
 };
 
 #endif // NOTEEDITOR_H
@@ -0,0 +1,104 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "NoteSummary.h"
+
+//resolution of the finest level in us, each level after it is
+//LEVEL_FACTOR times coarser
+#define FINEST_RESOLUTION 16000
+#define LEVEL_FACTOR 4
+#define NUM_LEVELS 6
+//a track is summarized once it averages this many notes per resolution
+#define MIN_NOTES_PER_STEP 1
+
+void NoteSummary::clear()
+{
+    levels.clear();
+}
+
+void NoteSummary::build(const std::vector<int>& notes, const uint64_t* times,
+                        const uint32_t* durations, const uint8_t* values)
+{
+    levels.assign(NUM_LEVELS, Level());
+
+    //each note as a span of its own, grouped by value keeping time order.
+    //Tracks only hold values up to 127, but anything past that is skipped
+    //rather than trusted as an index.
+    Level notes_level;
+    int counts[129] = {0};
+    for (int idx : notes){
+        if (values[idx] <= 127){
+            counts[values[idx] + 1]++;
+        }
+    }
+    for (int v = 0; v < 128; v++){
+        counts[v + 1] += counts[v];
+    }
+    std::copy(counts, counts + 129, notes_level.offsets);
+    notes_level.spans.resize(counts[128]);
+    for (int idx : notes){
+        if (values[idx] > 127){
+            continue;
+        }
+        Span& span = notes_level.spans[counts[values[idx]]++];
+        span.start = times[idx];
+        span.end = times[idx] + durations[idx];
+    }
+
+    uint64_t resolution = FINEST_RESOLUTION;
+    merge(notes_level, resolution, levels[0]);
+    for (int i = 1; i < NUM_LEVELS; i++){
+        resolution *= LEVEL_FACTOR;
+        merge(levels[i - 1], resolution, levels[i]);
+    }
+}
+
+int NoteSummary::levelFor(uint64_t resolution, size_t num_notes, uint64_t duration)
+{
+    if (resolution < FINEST_RESOLUTION
+        || num_notes * resolution < MIN_NOTES_PER_STEP * duration){
+        return -1;
+    }
+    int level = 0;
+    uint64_t next = FINEST_RESOLUTION * LEVEL_FACTOR;
+    while (level + 1 < NUM_LEVELS && next <= resolution){
+        level++;
+        next *= LEVEL_FACTOR;
+    }
+    return level;
+}
+
+void NoteSummary::merge(const Level& level, uint64_t resolution, Level& merged)
+{
+    merged.spans.clear();
+    merged.offsets[0] = 0;
+    for (int v = 0; v < 128; v++){
+        int first = merged.spans.size();
+        for (int i = level.offsets[v]; i < level.offsets[v + 1]; i++){
+            const Span& span = level.spans[i];
+            //spans sorted by start can still end out of order if one holds
+            //over another, so take the latest end
+            if (static_cast<int>(merged.spans.size()) > first
+                && span.start <= merged.spans.back().end + resolution){
+                merged.spans.back().end = std::max(merged.spans.back().end, span.end);
+            } else {
+                merged.spans.push_back(span);
+            }
+        }
+        merged.offsets[v + 1] = merged.spans.size();
+    }
+    merged.spans.shrink_to_fit();
+}
@@ -0,0 +1,80 @@
+#ifndef NOTESUMMARY_H
+#define NOTESUMMARY_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+//coarser and coarser outlines of where a track's notes are, for drawing
+//zoomed out views without visiting every note. At each level, notes of the
+//same value that overlap or are less than the level's resolution apart are
+//merged into one span, so a stretch of time holds at most one span per
+//resolution per note value however many notes are in it.
+class NoteSummary {
+public:
+    NoteSummary() {}
+
+    void clear();
+    //summarizes the NoteOns at the given event indices, in time order
+    void build(const std::vector<int>& notes, const uint64_t* times,
+               const uint32_t* durations, const uint8_t* values);
+    //the coarsest level no coarser than resolution (in us), or -1 if there
+    //isn't one or num_notes over duration is too sparse for merging to save
+    //much over drawing the notes themselves
+    static int levelFor(uint64_t resolution, size_t num_notes, uint64_t duration);
+
+    //calls func(value, start, end) in time order for each value's spans on
+    //level overlapping [t0, t1], stopping early if func returns false
+    template <class Func>
+    void query(int level, uint64_t t0, uint64_t t1, Func func) const
+    {
+        const Level& lvl = levels[level];
+        for (int value = 0; value < 128; value++){
+            auto first = lvl.spans.begin() + lvl.offsets[value];
+            auto last = lvl.spans.begin() + lvl.offsets[value + 1];
+            //spans of one value don't overlap, so they end in order too
+            auto it = std::lower_bound(first, last, t0,
+                                       [](const Span& s, uint64_t t) { return s.end < t; });
+            for (; it != last && it->start <= t1; ++it){
+                if (!func(value, it->start, it->end)){
+                    return;
+                }
+            }
+        }
+    }
+
+private:
+    struct Span {
+        uint64_t start;
+        uint64_t end;
+    };
+
+    struct Level {
+        //sorted by value, then time
+        std::vector<Span> spans;
+        //spans of value v are [offsets[v], offsets[v + 1])
+        int offsets[129];
+    };
+
+    //merges the spans of level into a new level with gaps up to resolution closed
+    static void merge(const Level& level, uint64_t resolution, Level& merged);
+
+    std::vector<Level> levels;
+};
+
+#endif /* NOTESUMMARY_H */
@@ -0,0 +1,540 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include "Playback.h"
+#include "Viewport.h"
+
+//events are handed to the synth this far ahead of playback (in us) when it
+//can schedule them, so they're played on time however late we wake up
+#define LOOKAHEAD 50000
+//range of playback rates
+#define MIN_RATE 0.25
+#define MAX_RATE 4.0
+//shortest loop, in us
+#define MIN_LOOP_LENGTH 10000
+
+Playback::Playback(Viewport* view) : view(view), anchor_song(0), anchor_delay(0), rate(1.0),
+                                     prev_rate(1.0), time_elapsed(0),
+                                     playing(false), stopping(false), play_from(0), offset(0),
+                                     loop_start(0), loop_end(0), generation(0),
+                                     chase_pending(false), key_updates_lost(false)
+{
+    sequencer = std::thread(&Playback::sequencerLoop, this);
+}
+
+Playback::~Playback()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        stopping = true;
+    }
+    wake.notify_one();
+    sequencer.join();
+}
+
+uint64_t Playback::getTime() const
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    return currentTime();
+}
+
+uint64_t Playback::currentTime() const
+{
+    if (!playing){
+        return time_elapsed;
+    }
+    uint64_t time = playedTime();
+    //once wrapped around, anchor_song may be past the end of the loop
+    if ((offset > 0 || loopsFrom(anchor_song)) && time >= loop_end){
+        time = loop_start + (time - loop_end) % (loop_end - loop_start);
+    }
+    return time;
+}
+
+uint64_t Playback::playedTime() const
+{
+    if (!playing){
+        return time_elapsed;
+    }
+    double elapsed = std::chrono::duration_cast<std::chrono::microseconds>
+        (std::chrono::steady_clock::now() - anchor_wall).count();
+    if (elapsed < anchor_delay){
+        return anchor_song - static_cast<uint64_t>((anchor_delay - elapsed) * prev_rate);
+    }
+    return anchor_song + static_cast<uint64_t>((elapsed - anchor_delay) * rate);
+}
+
+uint64_t Playback::wallTime(uint64_t time) const
+{
+    if (time <= anchor_song){
+        uint64_t before = static_cast<uint64_t>((anchor_song - time) / prev_rate);
+        return anchor_delay > before ? anchor_delay - before : 0;
+    }
+    return anchor_delay + static_cast<uint64_t>((time - anchor_song) / rate);
+}
+
+bool Playback::loopsFrom(uint64_t time) const
+{
+    return loop_end > loop_start && time <= loop_end;
+}
+
+Synth* Playback::getSynth()
+{
+    return &synth;
+}
+
+void Playback::loadSynth(std::string driver, std::string sf_file)
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        synth.load(driver, sf_file);
+    }
+    wake.notify_one();
+}
+
+void Playback::reloadSynth(std::string driver, std::string sf_file)
+{
+    uint64_t time;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        synth.reload(driver, sf_file);
+        //events scheduled on the old synth went with it
+        reanchor();
+        time = currentTime();
+    }
+    wake.notify_one();
+    refreshKeyboard(time);
+}
+
+void Playback::seek(uint64_t time)
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        time_elapsed = time;
+        play_from = time;
+        resetCursor();
+        //anything the sequencer played before now is stale
+        generation++;
+        synth.cancelScheduled();
+        synth.clear();
+        if (playing){
+            anchor(time);
+        }
+        chase(time, playing);
+        chase_pending = !playing;
+    }
+    wake.notify_one();
+    refreshKeyboard(time);
+    view->timeChanged();
+}
+
+void Playback::pause()
+{
+    uint64_t time;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        time_elapsed = currentTime();
+        playing = false;
+        //take back what was scheduled past the pause, it's sent again on play()
+        synth.cancelScheduled();
+        play_from = time_elapsed;
+        resetCursor();
+        //key updates are in played time, which starts over on play()
+        generation++;
+        time = time_elapsed;
+    }
+    wake.notify_one();
+    refreshKeyboard(time);
+}
+
+void Playback::play()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        anchor(time_elapsed);
+        if (chase_pending){
+            chase(time_elapsed, true);
+            chase_pending = false;
+        }
+        time_elapsed = 0;
+        playing = true;
+    }
+    wake.notify_one();
+    view->startFrames();
+}
+
+void Playback::setRate(double rate)
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        rate = std::min(std::max(rate, MIN_RATE), MAX_RATE);
+        if (playing){
+            changeRate(rate);
+        } else {
+            this->rate = rate;
+        }
+    }
+    //the sequencer may be waiting for an event that's now sooner
+    wake.notify_one();
+}
+
+double Playback::getRate() const
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    return rate;
+}
+
+void Playback::setLoop(uint64_t start, uint64_t end)
+{
+    uint64_t time;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        reanchor();
+        //too short a loop would keep the sequencer wrapping around
+        if (end < start + MIN_LOOP_LENGTH){
+            start = end = 0;
+        }
+        loop_start = start;
+        loop_end = end;
+        resetCursor();
+        time = currentTime();
+    }
+    wake.notify_one();
+    refreshKeyboard(time);
+}
+
+bool Playback::isLooping() const
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    return loop_end > loop_start;
+}
+
+void Playback::tracksChanged()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        resetCursor();
+    }
+    //the next event may be sooner than the one the sequencer is waiting for
+    wake.notify_one();
+}
+
+void Playback::anchor(uint64_t time)
+{
+    anchor_wall = std::chrono::steady_clock::now();
+    anchor_song = time;
+    anchor_delay = 0;
+    offset = 0;
+    synth.startSchedule(0);
+}
+
+void Playback::reanchor()
+{
+    if (!playing){
+        return;
+    }
+    //what's scheduled was timed for the old clock, send it again from here;
+    //notes already sounding carry on so nothing is restarted
+    uint64_t time = currentTime();
+    generation++;
+    synth.cancelScheduled();
+    anchor(time);
+    play_from = time;
+    resetCursor();
+}
+
+void Playback::changeRate(double new_rate)
+{
+    //what's scheduled is left alone and the new rate takes over where it
+    //ends, so nothing is sent again and the cursor stays where it is
+    uint64_t sent = play_from + offset;
+    uint64_t time = playedTime();
+    auto now = std::chrono::steady_clock::now();
+    uint64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - anchor_wall).count();
+    uint64_t due = wallTime(sent);
+    anchor_wall = now;
+    if (sent > time && due > elapsed){
+        anchor_song = sent;
+        anchor_delay = due - elapsed;
+        prev_rate = static_cast<double>(sent - time) / anchor_delay;
+    } else {
+        anchor_song = time;
+        anchor_delay = 0;
+    }
+    rate = new_rate;
+    synth.startSchedule(0);
+}
+
+void Playback::resetCursor()
+{
+    MIDIData* data = view->getMIDIData();
+    cursor_tracks.clear();
+    for (int i = 0; i < data->numTracks(); i++){
+        cursor_tracks.push_back(data->getTrack(i));
+    }
+    cursor.reset(cursor_tracks, play_from);
+
+    loop_keys.clear();
+    loop_state = ChannelState();
+    loop_releases = ChannelState();
+    if (loop_end <= loop_start){
+        return;
+    }
+    loop_cursor.reset(cursor_tracks, loop_start);
+    //worked out up front, so wrapping around doesn't have to look anything up
+    for (auto track : cursor_tracks){
+        KeyUpdate update;
+        update.time = 0;
+        update.generation = 0;
+        track->getColour(update.r, update.g, update.b);
+        size_t first = loop_releases.held_notes.size();
+        track->getChannelState(loop_end, loop_releases);
+        update.on = false;
+        for (size_t n = first; n < loop_releases.held_notes.size(); n++){
+            update.key = loop_releases.held_notes[n].key;
+            loop_keys.insert(loop_keys.begin(), update);
+        }
+        first = loop_state.held_notes.size();
+        track->getChannelState(loop_start, loop_state);
+        update.on = true;
+        for (size_t n = first; n < loop_state.held_notes.size(); n++){
+            update.key = loop_state.held_notes[n].key;
+            loop_keys.push_back(update);
+        }
+    }
+}
+
+void Playback::chase(uint64_t time, bool notes)
+{
+    MIDIData* data = view->getMIDIData();
+    ChannelState state;
+    for (int i = 0; i < data->numTracks(); i++){
+        data->getTrack(i)->getChannelState(time, state);
+    }
+    //channels the song hasn't set a program on yet keep whatever they have
+    for (int c = 0; c < 16; c++){
+        if (state.programs[c] >= 0){
+            synth.programChange(c, state.programs[c]);
+        }
+    }
+    if (notes){
+        for (auto &note : state.held_notes){
+            synth.noteOn(note.channel, note.key, note.velocity);
+        }
+    }
+}
+
+void Playback::everyFrame()
+{
+    //the keyboard only redraws the keys that change, once per frame however
+    //many notes started or stopped
+    Keyboard* keyboard = view->getKeyboard();
+    KeyUpdate update;
+    size_t num_pending = pending_keys.size();
+
+    while (key_updates.pop(update)){
+        if (update.generation == generation){
+            pending_keys.push_back(update);
+        }
+    }
+    //the sequencer sends each track's events ahead of time in turn, so
+    //put them back in time order
+    if (pending_keys.size() > num_pending){
+        std::stable_sort(pending_keys.begin(), pending_keys.end(),
+                         [](const KeyUpdate& a, const KeyUpdate& b) { return a.time < b.time; });
+    }
+
+    uint64_t now;
+    {
+        std::lock_guard<std::mutex> lk(mutex);
+        now = playedTime();
+    }
+    while (!pending_keys.empty() && pending_keys.front().time <= now){
+        update = pending_keys.front();
+        keyboard->setKey(update.key, update.on, update.r, update.g, update.b);
+        pending_keys.pop_front();
+    }
+    if (key_updates_lost.exchange(false)){
+        keyboard->clear();
+        showHeldNotes(getTime());
+    }
+}
+
+void Playback::sequencerLoop()
+{
+    std::unique_lock<std::mutex> data_lock(view->getMIDIData()->getMutex(), std::defer_lock);
+    std::unique_lock<std::mutex> lk(mutex, std::defer_lock);
+
+    std::lock(data_lock, lk);
+    while (!stopping){
+        uint64_t next = UINT64_MAX;
+        uint64_t ahead = lookahead();
+        if (playing){
+            next = dispatchDue(playedTime() + static_cast<uint64_t>(ahead * rate));
+        }
+        data_lock.unlock();
+
+        //sleep until the next event has to be sent, seek(), play(), pause()
+        //etc. wake us early so we always work from the current state
+        if (!playing || next == UINT64_MAX){
+            wake.wait(lk);
+        } else {
+            uint64_t send_at = wallTime(next);
+            send_at = send_at > ahead ? send_at - ahead : 0;
+            wake.wait_until(lk, anchor_wall + std::chrono::microseconds(send_at));
+        }
+        lk.unlock();
+        std::lock(data_lock, lk);
+    }
+}
+
+uint64_t Playback::dispatchDue(uint64_t until)
+{
+    auto dispatch = [&](const Track* track, int begin, int end) {
+        dispatchEvents(track, begin, end);
+    };
+
+    //tracks were added since the last seek
+    if (cursor.numTracks() != view->getMIDIData()->numTracks()){
+        resetCursor();
+    }
+    //cursor and play_from are in song time, until is in played time
+    while (loopsFrom(play_from) && until >= loop_end + offset){
+        cursor.advance(loop_end - 1, dispatch);
+        wrapLoop();
+    }
+    uint64_t time = until - offset;
+    cursor.advance(time, dispatch);
+    play_from = std::max(play_from, time + 1);
+
+    uint64_t next = cursor.nextTime();
+    //wake up to wrap around even if the rest of the loop is silent
+    if (loopsFrom(play_from)){
+        next = std::min(next, loop_end);
+    }
+    return next == UINT64_MAX ? next : next + offset;
+}
+
+void Playback::wrapLoop()
+{
+    uint64_t time = wallTime(loop_end + offset);
+    for (auto &note : loop_releases.held_notes){
+        synth.noteOffAt(time, note.channel, note.key);
+    }
+    //a channel only first set inside the loop goes back to the default, so
+    //every time round sounds the same
+    for (int c = 0; c < 16; c++){
+        if (loop_state.programs[c] >= 0){
+            synth.programChangeAt(time, c, loop_state.programs[c]);
+        } else if (loop_releases.programs[c] >= 0){
+            synth.programChangeAt(time, c, 0);
+        }
+    }
+    for (auto &note : loop_state.held_notes){
+        synth.noteOnAt(time, note.channel, note.key, note.velocity);
+    }
+    for (auto update : loop_keys){
+        update.time = loop_end + offset;
+        update.generation = generation;
+        if (!key_updates.push(update)){
+            key_updates_lost = true;
+        }
+    }
+
+    //copying into a cursor of the same size doesn't allocate
+    cursor = loop_cursor;
+    offset += loop_end - loop_start;
+    play_from = loop_start;
+}
+
+uint64_t Playback::lookahead() const
+{
+    return synth.canSchedule() ? LOOKAHEAD : 0;
+}
+
+void Playback::dispatchEvents(const Track* track, int begin, int end)
+{
+    KeyUpdate update;
+    update.generation = generation;
+    track->getColour(update.r, update.g, update.b);
+
+    for (int i = begin; i < end; i++){
+        short channel = track->getChannel(i);
+        short value = track->getValue(i);
+        uint64_t played = track->getTime(i) + offset;
+        uint64_t time = wallTime(played);
+        switch (track->getKind(i)){
+        case EventKind::NoteOn:
+            synth.noteOnAt(time, channel, value, track->getVelocity(i));
+            update.time = played;
+            update.key = value;
+            update.on = true;
+            if (!key_updates.push(update)){
+                key_updates_lost = true;
+            }
+            break;
+        case EventKind::NoteOff:
+            synth.noteOffAt(time, channel, value);
+            update.time = played;
+            update.key = value;
+            update.on = false;
+            if (!key_updates.push(update)){
+                key_updates_lost = true;
+            }
+            break;
+        case EventKind::ProgramChange:
+            synth.programChangeAt(time, channel, value);
+            break;
+        }
+    }
+}
+
+void Playback::showHeldNotes(uint64_t time)
+{
+    MIDIData* data = view->getMIDIData();
+    int num_tracks = data->numTracks();
+    for (int i = 0; i < num_tracks; i++){
+        Track* track = data->getTrack(i);
+        char r, g, b;
+        track->getColour(r, g, b);
+        track->forNotesIn(time, time, [&](int idx) {
+            if (track->getTime(idx) < time && track->getTime(idx) + track->getNoteDuration(idx) > time){
+                view->getKeyboard()->setKey(track->getValue(idx), true, r, g, b);
+            }
+            return true;
+        });
+    }
+}
+
+void Playback::refreshKeyboard(uint64_t time)
+{
+    pending_keys.clear();
+    view->getKeyboard()->clear();
+    showHeldNotes(time);
+    view->redrawEditor();
+}
+
+std::string Playback::getTimeString() const
+{
+    uint64_t time = getTime() / 1000;
+    std::ostringstream tstr;
+    tstr << time / 60000 << ":" << std::setfill('0') << std::setw(2)
+        << (time % 60000) / 1000;
+    return tstr.str();
+}
@@ -0,0 +1,164 @@
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <vector>
+#include <deque>
+#include <string>
+#include <chrono>
+#include <cstdint>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "MIDI.h"
+#include "Synth.h"
+#include "SPSCQueue.h"
+
+class Viewport;
+
+//a key pressed or released by the sequencer, for the UI to show
+struct KeyUpdate {
+    uint64_t time; //of the event, in us
+    short key;
+    bool on;
+    char r, g, b;
+    //updates from before the latest seek are dropped
+    unsigned generation;
+};
+
+class Playback {
+public:
+    //starts the sequencer thread, which plays the events while playing
+    Playback(Viewport* view);
+    ~Playback();
+
+    //current playback time in us
+    uint64_t getTime() const;
+    bool isPlaying() const { return playing; }
+    Synth* getSynth();
+    //loads the synth at startup; the sequencer thread is already running, so
+    //this goes through the same lock as everything else it reads
+    void loadSynth(std::string driver, std::string sf_file);
+    //swaps the synth's driver and soundfont without pulling it out from under
+    //the sequencer
+    void reloadSynth(std::string driver, std::string sf_file);
+    void seek(uint64_t time);
+    void pause();
+    void play();
+    //playback speed, 1 plays the song as written, clamped to 0.25-4
+    void setRate(double rate);
+    double getRate() const;
+    //once playback reaches it, [start, end) in us is played over and over
+    //until the loop is cleared with end <= start
+    void setLoop(uint64_t start, uint64_t end);
+    bool isLooping() const;
+    //call after adding or removing events, so the sequencer picks up
+    //where it was in the changed tracks
+    void tracksChanged();
+    //called every frame from the UI thread, shows the keys the sequencer
+    //pressed and released up to now
+    void everyFrame();
+    std::string getTimeString() const;
+
+private:
+    void sequencerLoop();
+    //plays every event due by time, returns the time of the next event or
+    //UINT64_MAX if there are none left
+    uint64_t dispatchDue(uint64_t time);
+    //how far ahead of playback events are handed to the synth, in us
+    uint64_t lookahead() const;
+    //plays events [begin, end) of track
+    void dispatchEvents(const Track* track, int begin, int end);
+    //releases the notes held over the end of the loop and starts the ones held
+    //over its start, then carries on from the start of the loop
+    void wrapLoop();
+    //whether playback from time runs into the loop
+    bool loopsFrom(uint64_t time) const;
+    //moves the cursor to play_from in the current tracks, and the loop cursor
+    //to the start of the loop
+    void resetCursor();
+    //starts the playback clock from song time time, now
+    void anchor(uint64_t time);
+    //restarts the clock from where playback is and sends what was scheduled
+    //again, for changing the loop or synth on the fly
+    void reanchor();
+    //switches the clock to new_rate from the end of what's been scheduled
+    void changeRate(double new_rate);
+    //restores the programs in effect at time, and if notes is set starts the
+    //notes held across it
+    void chase(uint64_t time, bool notes);
+    //song time, wrapped into the loop
+    uint64_t currentTime() const;
+    //song time as if the loop were laid out end to end, what the sequencer
+    //and key updates work in
+    uint64_t playedTime() const;
+    //us after anchor_wall when playback reaches played time time
+    uint64_t wallTime(uint64_t time) const;
+    //lights up the keys of the notes held across time
+    void showHeldNotes(uint64_t time);
+    //drops the key updates on their way, shows the keys held at time and
+    //redraws the editor there
+    void refreshKeyboard(uint64_t time);
+
+    Viewport* view;
+    Synth synth;
+    //guards the synth and everything below shared with the sequencer thread;
+    //when the MIDIData mutex is needed too it has to be locked first
+    mutable std::mutex mutex;
+    std::condition_variable wake;
+    //while playing, played time anchor_song is reached anchor_delay us after
+    //anchor_wall and moves on at rate from there. Until then it moves at
+    //prev_rate, while what was scheduled before a rate change plays out
+    std::chrono::steady_clock::time_point anchor_wall;
+    uint64_t anchor_song;
+    uint64_t anchor_delay;
+    double rate;
+    double prev_rate;
+    //for storing the time when we pause, in us
+    uint64_t time_elapsed;
+    bool playing;
+    bool stopping;
+    std::vector<const Track*> cursor_tracks;
+    MergedCursor cursor;
+    //events at or after this time (in us) haven't been played yet
+    uint64_t play_from;
+    //played time minus song time, grows by the loop length every time
+    //the sequencer wraps around
+    uint64_t offset;
+    uint64_t loop_start;
+    uint64_t loop_end;
+    //kept at the start of the loop, so wrapping around is a copy
+    MergedCursor loop_cursor;
+    //programs and notes held over the start of the loop, and notes held
+    //over its end
+    ChannelState loop_state;
+    ChannelState loop_releases;
+    //key updates for wrapping around, offs then ons
+    std::vector<KeyUpdate> loop_keys;
+    unsigned generation;
+    //a seek while paused leaves the held notes for play() to start
+    bool chase_pending;
+    SPSCQueue<KeyUpdate, 4096> key_updates;
+    //set when the UI fell so far behind that key_updates filled up
+    std::atomic<bool> key_updates_lost;
+    //UI thread only: updates taken from key_updates that aren't due yet
+    std::deque<KeyUpdate> pending_keys;
+    std::thread sequencer;
+};
+
+#endif /* PLAYBACK_H */
@@ -0,0 +1,417 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <fstream>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cctype>
+#include <cmath>
+#ifdef HAVE_SNDFILE
+#include <sndfile.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RENDERER_SSE2
+#include <emmintrin.h>
+#endif
+#include "Renderer.h"
+#include "WorkerPool.h"
+
+#define SAMPLE_RATE 44100
+//frames each synth renders before they're mixed and written
+#define CHUNK_FRAMES 8192
+//rendered past the last event so the final notes can ring out, in us
+#define RELEASE_TAIL 2000000
+
+//16 bit stereo output file
+class AudioFile {
+public:
+    virtual ~AudioFile() {}
+    virtual void write(const int16_t* frames, int count) = 0;
+    //finishes the file, it's unusable if this isn't called
+    virtual void close() = 0;
+};
+
+class WAVFile : public AudioFile {
+public:
+    WAVFile(std::string filename) : file(filename, std::ios::binary), data_size(0)
+    {
+        //the sizes are filled in by close()
+        writeHeader();
+        if (!file) {
+            throw Renderer::RenderError("Failed to open " + filename + " for writing!");
+        }
+    }
+
+    virtual void write(const int16_t* frames, int count)
+    {
+        //samples go out as they are, every platform we build for is little
+        //endian like the file
+        file.write(reinterpret_cast<const char*>(frames), count * 4);
+        data_size += count * 4;
+        if (!file) {
+            throw Renderer::RenderError("Failed to write audio file!");
+        }
+    }
+
+    virtual void close()
+    {
+        file.seekp(0);
+        writeHeader();
+        file.close();
+        if (!file) {
+            throw Renderer::RenderError("Failed to write audio file!");
+        }
+    }
+
+private:
+    void writeHeader()
+    {
+        uint8_t header[44];
+        std::copy_n("RIFF", 4, header);
+        putLE32(header + 4, 36 + data_size);
+        std::copy_n("WAVEfmt ", 8, header + 8);
+        putLE32(header + 16, 16);
+        putLE16(header + 20, 1); //PCM
+        putLE16(header + 22, 2);
+        putLE32(header + 24, SAMPLE_RATE);
+        putLE32(header + 28, SAMPLE_RATE * 4);
+        putLE16(header + 32, 4);
+        putLE16(header + 34, 16);
+        std::copy_n("data", 4, header + 36);
+        putLE32(header + 40, data_size);
+        file.write(reinterpret_cast<const char*>(header), sizeof(header));
+    }
+
+    static void putLE16(uint8_t* out, uint16_t value)
+    {
+        out[0] = value & 0xff;
+        out[1] = value >> 8;
+    }
+
+    static void putLE32(uint8_t* out, uint32_t value)
+    {
+        putLE16(out, value & 0xffff);
+        putLE16(out + 2, value >> 16);
+    }
+
+    std::ofstream file;
+    uint32_t data_size;
+};
+
+#ifdef HAVE_SNDFILE
+class FLACFile : public AudioFile {
+public:
+    FLACFile(std::string filename)
+    {
+        SF_INFO info = SF_INFO();
+        info.samplerate = SAMPLE_RATE;
+        info.channels = 2;
+        info.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_16;
+        file = sf_open(filename.c_str(), SFM_WRITE, &info);
+        if (!file) {
+            throw Renderer::RenderError("Failed to open " + filename + " for writing!");
+        }
+    }
+
+    virtual ~FLACFile()
+    {
+        if (file) {
+            sf_close(file);
+        }
+    }
+
+    virtual void write(const int16_t* frames, int count)
+    {
+        if (sf_writef_short(file, frames, count) != count) {
+            throw Renderer::RenderError("Failed to write audio file!");
+        }
+    }
+
+    virtual void close()
+    {
+        int result = sf_close(file);
+        file = nullptr;
+        if (result != 0) {
+            throw Renderer::RenderError("Failed to write audio file!");
+        }
+    }
+
+private:
+    SNDFILE* file;
+};
+#endif
+
+static bool endsWith(const std::string& str, const std::string& suffix)
+{
+    if (str.size() < suffix.size()) {
+        return false;
+    }
+    return std::equal(suffix.begin(), suffix.end(), str.end() - suffix.size(),
+                      [](char a, char b) { return a == std::tolower(b); });
+}
+
+static uint64_t frameAt(uint64_t time)
+{
+    return time * SAMPLE_RATE / 1000000;
+}
+
+//adds count samples of in to out
+static void mix(float* out, const float* in, size_t count)
+{
+    size_t i = 0;
+#ifdef RENDERER_SSE2
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_loadu_ps(in + i)));
+    }
+#endif
+    for (; i < count; i++) {
+        out[i] += in[i];
+    }
+}
+
+//converts count samples to 16 bit, clipping anything outside -1 to 1
+static void toS16(const float* in, int16_t* out, size_t count)
+{
+    size_t i = 0;
+#ifdef RENDERER_SSE2
+    const __m128 lowest = _mm_set1_ps(-1.0f);
+    const __m128 highest = _mm_set1_ps(1.0f);
+    const __m128 scale = _mm_set1_ps(32767.0f);
+    for (; i + 8 <= count; i += 8) {
+        __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i), lowest), highest);
+        __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(in + i + 4), lowest), highest);
+        //rounds to nearest, the same as lrint() below
+        __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(_mm_mul_ps(a, scale)),
+                                         _mm_cvtps_epi32(_mm_mul_ps(b, scale)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), packed);
+    }
+#endif
+    for (; i < count; i++) {
+        float sample = std::min(std::max(in[i], -1.0f), 1.0f);
+        out[i] = static_cast<int16_t>(std::lrint(sample * 32767.0f));
+    }
+}
+
+Renderer::Renderer(MIDIData* data, std::string sf_file, unsigned num_synths)
+                  : sf_file(sf_file), duration(0), frames_done(0), cancelled(false),
+                    done(false)
+{
+    std::vector<RenderEvent> events;
+    {
+        std::lock_guard<std::mutex> lk(data->getMutex());
+        for (int i = 0; i < data->numTracks(); i++) {
+            Track* track = data->getTrack(i);
+            for (int e = 0; e < track->numEvents(); e++) {
+                RenderEvent ev = { track->getTime(e), track->getKind(e),
+                                   static_cast<uint8_t>(track->getChannel(e)),
+                                   static_cast<uint8_t>(track->getValue(e)),
+                                   static_cast<uint8_t>(track->getVelocity(e)) };
+                events.push_back(ev);
+            }
+        }
+    }
+    //each track is in order already, keeping their order at equal times
+    std::stable_sort(events.begin(), events.end(),
+                     [](const RenderEvent& a, const RenderEvent& b) { return a.time < b.time; });
+    if (!events.empty()) {
+        duration = events.back().time;
+    }
+    total_frames = frameAt(duration + RELEASE_TAIL);
+
+    //channels are independent in the synth, so each one can be played by any
+    //synth as long as all of its events go to the same one. Deal the busiest
+    //channels out first, each to the synth with the least to do so far.
+    size_t channel_events[16] = { 0 };
+    for (auto &ev : events) {
+        channel_events[ev.channel]++;
+    }
+    int channels[16];
+    int used_channels = 0;
+    for (int c = 0; c < 16; c++) {
+        channels[c] = c;
+        used_channels += channel_events[c] > 0;
+    }
+    std::stable_sort(channels, channels + 16,
+                     [&](int a, int b) { return channel_events[a] > channel_events[b]; });
+    if (num_synths == 0) {
+        num_synths = WorkerPool::shared().numThreads();
+    }
+    num_synths = std::max(1u, std::min(num_synths, static_cast<unsigned>(used_channels)));
+
+    std::vector<size_t> load(num_synths, 0);
+    int part_of[16];
+    for (int c : channels) {
+        int least = std::min_element(load.begin(), load.end()) - load.begin();
+        part_of[c] = least;
+        load[least] += channel_events[c];
+    }
+    parts.resize(num_synths);
+    for (auto &part : parts) {
+        part.synth.reset(new Synth());
+        part.next_event = 0;
+        part.frame = 0;
+    }
+    for (auto &ev : events) {
+        parts[part_of[ev.channel]].events.push_back(ev);
+    }
+}
+
+Renderer::~Renderer()
+{
+    cancelled = true;
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+void Renderer::render(std::string filename)
+{
+    //every synth loads the soundfont itself: fluidsynth counts references to
+    //its samples as voices start and stop without any locking, so synths
+    //rendering at the same time can't share one. From 2.x on the sample data
+    //is cached and shared between loads of the same file anyway.
+    //each part only gets its share of the voices, so a dense song has voices
+    //stolen about as it would playing live through one synth
+    for (auto &part : parts) {
+        part.synth->loadOffline(sf_file, SAMPLE_RATE, 1.0 / parts.size());
+        part.buffer.resize(2 * CHUNK_FRAMES);
+    }
+
+    std::unique_ptr<AudioFile> file;
+    if (endsWith(filename, ".flac")) {
+#ifdef HAVE_SNDFILE
+        file.reset(new FLACFile(filename));
+#else
+        throw RenderError("This build can't write FLAC files, use .wav instead!");
+#endif
+    } else {
+        file.reset(new WAVFile(filename));
+    }
+
+    std::vector<int16_t> output(2 * CHUNK_FRAMES);
+    try {
+        for (uint64_t start = 0; start < total_frames && !cancelled; start += CHUNK_FRAMES) {
+            uint64_t end = std::min<uint64_t>(start + CHUNK_FRAMES, total_frames);
+            std::vector<WorkerPool::Task> tasks;
+            std::vector<size_t> costs;
+            for (auto &part : parts) {
+                tasks.push_back(std::bind(&Renderer::renderPart, this, std::ref(part), end));
+                costs.push_back(part.events.size());
+            }
+            for (auto &error : WorkerPool::shared().run(tasks, costs)) {
+                if (error) {
+                    std::rethrow_exception(error);
+                }
+            }
+
+            size_t samples = 2 * (end - start);
+            for (size_t i = 1; i < parts.size(); i++) {
+                mix(parts[0].buffer.data(), parts[i].buffer.data(), samples);
+            }
+            toS16(parts[0].buffer.data(), output.data(), samples);
+            file->write(output.data(), end - start);
+            frames_done = end;
+        }
+        if (!cancelled) {
+            file->close();
+            return;
+        }
+    } catch (...) {
+        //don't leave half a file behind
+        file.reset();
+        std::remove(filename.c_str());
+        throw;
+    }
+    file.reset();
+    std::remove(filename.c_str());
+}
+
+void Renderer::renderPart(Part& part, uint64_t end)
+{
+    float* out = part.buffer.data();
+    //synthesizes up to the frame each event falls on before playing it; the
+    //synth runs in blocks of its own, so an event can take effect up to one
+    //of those (64 frames) later
+    while (true) {
+        while (part.next_event < part.events.size() &&
+               frameAt(part.events[part.next_event].time) <= part.frame) {
+            const RenderEvent& ev = part.events[part.next_event++];
+            switch (ev.kind) {
+            case EventKind::NoteOn:
+                part.synth->noteOn(ev.channel, ev.value, ev.velocity);
+                break;
+            case EventKind::NoteOff:
+                part.synth->noteOff(ev.channel, ev.value);
+                break;
+            case EventKind::ProgramChange:
+                part.synth->programChange(ev.channel, ev.value);
+                break;
+            }
+        }
+        if (part.frame >= end) {
+            return;
+        }
+        uint64_t until = end;
+        if (part.next_event < part.events.size()) {
+            until = std::min(until, frameAt(part.events[part.next_event].time));
+        }
+        part.synth->write(out, static_cast<int>(until - part.frame));
+        out += 2 * (until - part.frame);
+        part.frame = until;
+    }
+}
+
+void Renderer::start(std::string filename)
+{
+    thread = std::thread(&Renderer::renderInBackground, this, filename);
+}
+
+bool Renderer::finished()
+{
+    std::lock_guard<std::mutex> lk(mutex);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    return done;
+}
+
+double Renderer::progress() const
+{
+    if (total_frames == 0) {
+        return 1.0;
+    }
+    return static_cast<double>(frames_done) / total_frames;
+}
+
+uint64_t Renderer::getDuration() const
+{
+    return duration;
+}
+
+void Renderer::renderInBackground(std::string filename)
+{
+    try {
+        render(filename);
+    } catch (...) {
+        std::lock_guard<std::mutex> lk(mutex);
+        error = std::current_exception();
+        return;
+    }
+    std::lock_guard<std::mutex> lk(mutex);
+    done = true;
+}
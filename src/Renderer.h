@@ -0,0 +1,103 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <exception>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include "MIDI.h"
+#include "Synth.h"
+
+//plays a song through its own synths without an audio driver, as fast as
+//they can go, and writes what comes out to a file. The 16 channels are split
+//between several synths, each with its own copy of the soundfont, rendered
+//on the worker pool and mixed back together.
+class Renderer {
+public:
+    //copies the events out of data, so it can go on being played and edited
+    //while rendering; 0 synths means as many as there are cores, but never
+    //more than there are channels in use
+    Renderer(MIDIData* data, std::string sf_file, unsigned num_synths = 0);
+    //stops any rendering still going on in the background
+    ~Renderer();
+
+    //renders the whole song into filename before returning, as FLAC if it
+    //ends in .flac and the build supports it, otherwise as WAV
+    void render(std::string filename);
+    //renders into filename on a background thread
+    void start(std::string filename);
+    //whether a start()ed render is done, rethrows any error it ran into
+    bool finished();
+    //fraction of the song rendered so far, from 0 to 1
+    double progress() const;
+    //length of the song in us, not counting the release at the end
+    uint64_t getDuration() const;
+
+    class RenderError : public std::exception {
+    public:
+        RenderError(std::string error) : error(error) {}
+        virtual const char* what() const noexcept { return error.c_str(); }
+    private:
+        std::string error;
+    };
+
+private:
+    struct RenderEvent {
+        uint64_t time;
+        EventKind kind;
+        uint8_t channel;
+        uint8_t value;
+        uint8_t velocity;
+    };
+
+    //one synth and the channels it plays
+    struct Part {
+        std::unique_ptr<Synth> synth;
+        //events on the part's channels, in time order
+        std::vector<RenderEvent> events;
+        size_t next_event;
+        uint64_t frame;
+        //interleaved stereo for the chunk being rendered
+        std::vector<float> buffer;
+    };
+
+    //render() for start(), keeps the error for finished()
+    void renderInBackground(std::string filename);
+    //synthesizes part up to frame end into its buffer, playing its events
+    //as their frames come up
+    void renderPart(Part& part, uint64_t end);
+
+    std::string sf_file;
+    //created up front, the rendering thread only loads their synths
+    std::vector<Part> parts;
+    uint64_t duration;
+    uint64_t total_frames;
+    std::atomic<uint64_t> frames_done;
+    std::atomic<bool> cancelled;
+    std::thread thread;
+    //guards done and error
+    std::mutex mutex;
+    bool done;
+    std::exception_ptr error;
+};
+
+#endif /* RENDERER_H */
@@ -177,7 +177,7 @@ void SettingsDialog::cbFileChooser(Fl_Widget* w, void* v)
 	    return; //user cancelled
     }
     try {
-        synth->reload(driver, std::string(diag->chooser.filename()));
+        diag->view->getPlayback()->reloadSynth(driver, std::string(diag->chooser.filename()));
     } catch (std::exception &e){
         fl_alert(e.what());
     }
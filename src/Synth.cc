@@ -16,15 +16,23 @@
  */
 #ifdef _MSC_VER
 #include <Windows.h>
+#else
+#include <dlfcn.h>
 #endif
 #include "Synth.h"
 #include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
 
 typedef int (*PtrFluidSynthSfload)(fluid_synth_t*, const char*, int);
 typedef int (*PtrFluidSynthSfunload)(fluid_synth_t*, int id, int reset_presets);
 typedef fluid_settings_t* (*PtrNewFluidSettings)(void);
 typedef void (*PtrDeleteFluidSettings)(fluid_settings_t*);
 typedef int (*PtrFluidSettingsSetstr)(fluid_settings_t*, const char*, const char*);
+typedef int (*PtrFluidSettingsSetnum)(fluid_settings_t*, const char*, double);
+typedef int (*PtrFluidSettingsSetint)(fluid_settings_t*, const char*, int);
+typedef int (*PtrFluidSettingsGetint)(fluid_settings_t*, const char*, int*);
 typedef fluid_synth_t* (*PtrNewFluidSynth)(fluid_settings_t* settings);
 typedef void (*PtrDeleteFluidSynth)(fluid_synth_t*);
 typedef fluid_audio_driver_t* (*PtrNewFluidAudioDriver)(fluid_settings_t*, fluid_synth_t*);
@@ -32,6 +40,27 @@ typedef void (*PtrDeleteFluidAudioDriver)(fluid_audio_driver_t*);
 typedef int (*PtrFluidSynthNoteon)(fluid_synth_t*, int, int, int);
 typedef int (*PtrFluidSynthNoteoff)(fluid_synth_t*, int, int);
 typedef int (*PtrFluidSynthProgramChange)(fluid_synth_t*, int, int);
+typedef int (*PtrFluidSynthAllNotesOff)(fluid_synth_t*, int);
+typedef int (*PtrFluidSynthWriteFloat)(fluid_synth_t*, int, void*, int, int, void*, int, int);
+typedef fluid_sequencer_t* (*PtrNewFluidSequencer2)(int);
+typedef void (*PtrDeleteFluidSequencer)(fluid_sequencer_t*);
+typedef fluid_seq_id_t (*PtrFluidSequencerRegisterFluidsynth)(fluid_sequencer_t*, fluid_synth_t*);
+typedef unsigned int (*PtrFluidSequencerGetTick)(fluid_sequencer_t*);
+typedef void (*PtrFluidSequencerSetTimeScale)(fluid_sequencer_t*, double);
+typedef double (*PtrFluidSequencerGetTimeScale)(fluid_sequencer_t*);
+typedef int (*PtrFluidSequencerSendAt)(fluid_sequencer_t*, fluid_event_t*, unsigned int, int);
+typedef void (*PtrFluidSequencerRemoveEvents)(fluid_sequencer_t*, fluid_seq_id_t, fluid_seq_id_t, int);
+typedef fluid_event_t* (*PtrNewFluidEvent)(void);
+typedef void (*PtrDeleteFluidEvent)(fluid_event_t*);
+typedef void (*PtrFluidEventSetSource)(fluid_event_t*, fluid_seq_id_t);
+typedef void (*PtrFluidEventSetDest)(fluid_event_t*, fluid_seq_id_t);
+typedef void (*PtrFluidEventNoteon)(fluid_event_t*, int, short, int);
+typedef void (*PtrFluidEventNoteoff)(fluid_event_t*, int, short);
+typedef void (*PtrFluidEventProgramChange)(fluid_event_t*, int, int);
+typedef fluid_seq_id_t (*PtrFluidSequencerRegisterClient)(fluid_sequencer_t*, const char*, fluid_event_callback_t, void*);
+typedef void (*PtrFluidEventTimer)(fluid_event_t*, void*);
+typedef int (*PtrFluidEventGetType)(fluid_event_t*);
+typedef unsigned int (*PtrFluidEventGetTime)(fluid_event_t*);
 
 
 //function pointers for fluidsynth calls
@@ -41,6 +70,9 @@ PtrFluidSynthSfunload __fluid_synth_sfunload = nullptr;
 PtrNewFluidSettings __new_fluid_settings = nullptr;
 PtrDeleteFluidSettings __delete_fluid_settings = nullptr;
 PtrFluidSettingsSetstr __fluid_settings_setstr = nullptr;
+PtrFluidSettingsSetnum __fluid_settings_setnum = nullptr;
+PtrFluidSettingsSetint __fluid_settings_setint = nullptr;
+PtrFluidSettingsGetint __fluid_settings_getint = nullptr;
 PtrNewFluidSynth __new_fluid_synth = nullptr;
 PtrDeleteFluidSynth __delete_fluid_synth = nullptr;
 PtrNewFluidAudioDriver __new_fluid_audio_driver = nullptr;
@@ -48,14 +80,59 @@ PtrDeleteFluidAudioDriver __delete_fluid_audio_driver = nullptr;
 PtrFluidSynthNoteon __fluid_synth_noteon = nullptr;
 PtrFluidSynthNoteoff __fluid_synth_noteoff = nullptr;
 PtrFluidSynthProgramChange __fluid_synth_program_change = nullptr;
+PtrFluidSynthAllNotesOff __fluid_synth_all_notes_off = nullptr;
+PtrFluidSynthWriteFloat __fluid_synth_write_float = nullptr;
+PtrNewFluidSequencer2 __new_fluid_sequencer2 = nullptr;
+PtrDeleteFluidSequencer __delete_fluid_sequencer = nullptr;
+PtrFluidSequencerRegisterFluidsynth __fluid_sequencer_register_fluidsynth = nullptr;
+PtrFluidSequencerGetTick __fluid_sequencer_get_tick = nullptr;
+PtrFluidSequencerSetTimeScale __fluid_sequencer_set_time_scale = nullptr;
+PtrFluidSequencerGetTimeScale __fluid_sequencer_get_time_scale = nullptr;
+PtrFluidSequencerSendAt __fluid_sequencer_send_at = nullptr;
+PtrFluidSequencerRemoveEvents __fluid_sequencer_remove_events = nullptr;
+PtrNewFluidEvent __new_fluid_event = nullptr;
+PtrDeleteFluidEvent __delete_fluid_event = nullptr;
+PtrFluidEventSetSource __fluid_event_set_source = nullptr;
+PtrFluidEventSetDest __fluid_event_set_dest = nullptr;
+PtrFluidEventNoteon __fluid_event_noteon = nullptr;
+PtrFluidEventNoteoff __fluid_event_noteoff = nullptr;
+PtrFluidEventProgramChange __fluid_event_program_change = nullptr;
+PtrFluidSequencerRegisterClient __fluid_sequencer_register_client = nullptr;
+PtrFluidEventTimer __fluid_event_timer = nullptr;
+PtrFluidEventGetType __fluid_event_get_type = nullptr;
+PtrFluidEventGetTime __fluid_event_get_time = nullptr;
 
 #ifdef _MSC_VER
 #define FLUID_DLL "libfluidsynth-1.dll"
 HINSTANCE fluidlib;
 #endif
 bool fluidloaded = false;
+bool sequencerloaded = false;
+
+//sequencer ticks per second, the sequencer's clock is an unsigned int so this
+//also limits how long it can run: 10000 ticks/s wraps after about 5 days.
+//fluidsynth 1.x clamps the scale to 1000, so events are placed to the ms there,
+//and every version only plays them at the start of a 64 sample block (about
+//1.45ms at 44.1kHz), whatever the scale
+#define SEQUENCER_TIME_SCALE 10000.0
+//how often (in us) the correction for the synth's clock drifting from the
+//system's is updated while events are being scheduled
+#define CLOCK_SYNC_INTERVAL 250000
+//each update moves the correction this fraction of the way, so a single bad
+//interval doesn't throw it off
+#define CLOCK_SYNC_SMOOTHING 4.0
+//one scheduled note on in this many is followed by a probe that measures
+//how late the sequencer dispatched it
+#define PROBE_EVERY 16
+//clear() turns off a channel with more notes than this sounding with one
+//all notes off, rather than a note off for each
+#define ALL_NOTES_OFF_AT 8
 
-Synth::Synth() : is_initialized(false)
+Synth::Synth() : is_initialized(false), clock_tick(0), clock_started(false), clock_correction(0.0),
+                 window_error(0.0), window_readings(0),
+                 syncs(0), sync_error_sum(0.0), sync_error_sq_sum(0.0), probes(0), probe_late_sum(0.0),
+                 probe_late_max(0.0), seq_id(-1), probe_id(-1), origin_time(0), time_scale(0.0),
+                 late_events(0), notes_scheduled(0), sf_handle(FLUID_FAILED)
 {
 #ifdef _MSC_VER
     fluidlib = LoadLibrary(TEXT(FLUID_DLL));
@@ -71,6 +148,11 @@ Synth::Synth() : is_initialized(false)
         if (!__new_fluid_settings) fluidloaded = false;
         __fluid_settings_setstr = (PtrFluidSettingsSetstr)GetProcAddress(fluidlib, "fluid_settings_setstr");
         if (!__fluid_settings_setstr) fluidloaded = false;
+        __fluid_settings_setnum = (PtrFluidSettingsSetnum)GetProcAddress(fluidlib, "fluid_settings_setnum");
+        if (!__fluid_settings_setnum) fluidloaded = false;
+        //optional, offline synths keep the default polyphony without them
+        __fluid_settings_setint = (PtrFluidSettingsSetint)GetProcAddress(fluidlib, "fluid_settings_setint");
+        __fluid_settings_getint = (PtrFluidSettingsGetint)GetProcAddress(fluidlib, "fluid_settings_getint");
         __new_fluid_synth = (PtrNewFluidSynth)GetProcAddress(fluidlib, "new_fluid_synth");
         if (!__new_fluid_synth) fluidloaded = false;
         __delete_fluid_synth = (PtrDeleteFluidSynth)GetProcAddress(fluidlib, "delete_fluid_synth");
@@ -85,6 +167,50 @@ Synth::Synth() : is_initialized(false)
         if (!__fluid_synth_noteoff) fluidloaded = false;
         __fluid_synth_program_change = (PtrFluidSynthProgramChange)GetProcAddress(fluidlib, "fluid_synth_program_change");
         if (!__fluid_synth_program_change) fluidloaded = false;
+        __fluid_synth_write_float = (PtrFluidSynthWriteFloat)GetProcAddress(fluidlib, "fluid_synth_write_float");
+        if (!__fluid_synth_write_float) fluidloaded = false;
+        //optional, clear() sends note offs one by one without it
+        __fluid_synth_all_notes_off = (PtrFluidSynthAllNotesOff)GetProcAddress(fluidlib, "fluid_synth_all_notes_off");
+        //the sequencer is optional, without it events are played as they come
+        sequencerloaded = true;
+        __new_fluid_sequencer2 = (PtrNewFluidSequencer2)GetProcAddress(fluidlib, "new_fluid_sequencer2");
+        if (!__new_fluid_sequencer2) sequencerloaded = false;
+        __delete_fluid_sequencer = (PtrDeleteFluidSequencer)GetProcAddress(fluidlib, "delete_fluid_sequencer");
+        if (!__delete_fluid_sequencer) sequencerloaded = false;
+        __fluid_sequencer_register_fluidsynth = (PtrFluidSequencerRegisterFluidsynth)GetProcAddress(fluidlib, "fluid_sequencer_register_fluidsynth");
+        if (!__fluid_sequencer_register_fluidsynth) sequencerloaded = false;
+        __fluid_sequencer_get_tick = (PtrFluidSequencerGetTick)GetProcAddress(fluidlib, "fluid_sequencer_get_tick");
+        if (!__fluid_sequencer_get_tick) sequencerloaded = false;
+        __fluid_sequencer_set_time_scale = (PtrFluidSequencerSetTimeScale)GetProcAddress(fluidlib, "fluid_sequencer_set_time_scale");
+        if (!__fluid_sequencer_set_time_scale) sequencerloaded = false;
+        __fluid_sequencer_get_time_scale = (PtrFluidSequencerGetTimeScale)GetProcAddress(fluidlib, "fluid_sequencer_get_time_scale");
+        if (!__fluid_sequencer_get_time_scale) sequencerloaded = false;
+        __fluid_sequencer_send_at = (PtrFluidSequencerSendAt)GetProcAddress(fluidlib, "fluid_sequencer_send_at");
+        if (!__fluid_sequencer_send_at) sequencerloaded = false;
+        __fluid_sequencer_remove_events = (PtrFluidSequencerRemoveEvents)GetProcAddress(fluidlib, "fluid_sequencer_remove_events");
+        if (!__fluid_sequencer_remove_events) sequencerloaded = false;
+        __new_fluid_event = (PtrNewFluidEvent)GetProcAddress(fluidlib, "new_fluid_event");
+        if (!__new_fluid_event) sequencerloaded = false;
+        __delete_fluid_event = (PtrDeleteFluidEvent)GetProcAddress(fluidlib, "delete_fluid_event");
+        if (!__delete_fluid_event) sequencerloaded = false;
+        __fluid_event_set_source = (PtrFluidEventSetSource)GetProcAddress(fluidlib, "fluid_event_set_source");
+        if (!__fluid_event_set_source) sequencerloaded = false;
+        __fluid_event_set_dest = (PtrFluidEventSetDest)GetProcAddress(fluidlib, "fluid_event_set_dest");
+        if (!__fluid_event_set_dest) sequencerloaded = false;
+        __fluid_event_noteon = (PtrFluidEventNoteon)GetProcAddress(fluidlib, "fluid_event_noteon");
+        if (!__fluid_event_noteon) sequencerloaded = false;
+        __fluid_event_noteoff = (PtrFluidEventNoteoff)GetProcAddress(fluidlib, "fluid_event_noteoff");
+        if (!__fluid_event_noteoff) sequencerloaded = false;
+        __fluid_event_program_change = (PtrFluidEventProgramChange)GetProcAddress(fluidlib, "fluid_event_program_change");
+        if (!__fluid_event_program_change) sequencerloaded = false;
+        //optional, dispatch lateness isn't measured without them
+        __fluid_sequencer_register_client = (PtrFluidSequencerRegisterClient)GetProcAddress(fluidlib, "fluid_sequencer_register_client");
+        __fluid_event_timer = (PtrFluidEventTimer)GetProcAddress(fluidlib, "fluid_event_timer");
+        __fluid_event_get_type = (PtrFluidEventGetType)GetProcAddress(fluidlib, "fluid_event_get_type");
+        __fluid_event_get_time = (PtrFluidEventGetTime)GetProcAddress(fluidlib, "fluid_event_get_time");
+        if (!__fluid_event_timer || !__fluid_event_get_type || !__fluid_event_get_time) {
+            __fluid_sequencer_register_client = nullptr;
+        }
     }
     else {
         MessageBox(NULL, "Failed to load " FLUID_DLL ", playback will be silent!",
@@ -97,6 +223,9 @@ Synth::Synth() : is_initialized(false)
     __new_fluid_settings = new_fluid_settings;
     __delete_fluid_settings = delete_fluid_settings;
     __fluid_settings_setstr = fluid_settings_setstr;
+    __fluid_settings_setnum = fluid_settings_setnum;
+    __fluid_settings_setint = fluid_settings_setint;
+    __fluid_settings_getint = fluid_settings_getint;
     __new_fluid_synth = new_fluid_synth;
     __delete_fluid_synth = delete_fluid_synth;
     __new_fluid_audio_driver = new_fluid_audio_driver;
@@ -104,12 +233,42 @@ Synth::Synth() : is_initialized(false)
     __fluid_synth_noteon = fluid_synth_noteon;
     __fluid_synth_noteoff = fluid_synth_noteoff;
     __fluid_synth_program_change = fluid_synth_program_change;
+    //optional like on Windows, looked up at run time so linking doesn't need
+    //a fluidsynth that has it
+    __fluid_synth_all_notes_off = (PtrFluidSynthAllNotesOff)dlsym(RTLD_DEFAULT, "fluid_synth_all_notes_off");
+    __fluid_synth_write_float = fluid_synth_write_float;
+    sequencerloaded = true;
+    __new_fluid_sequencer2 = new_fluid_sequencer2;
+    __delete_fluid_sequencer = delete_fluid_sequencer;
+    __fluid_sequencer_register_fluidsynth = fluid_sequencer_register_fluidsynth;
+    __fluid_sequencer_get_tick = fluid_sequencer_get_tick;
+    __fluid_sequencer_set_time_scale = fluid_sequencer_set_time_scale;
+    __fluid_sequencer_get_time_scale = fluid_sequencer_get_time_scale;
+    __fluid_sequencer_send_at = fluid_sequencer_send_at;
+    __fluid_sequencer_remove_events = fluid_sequencer_remove_events;
+    __new_fluid_event = new_fluid_event;
+    __delete_fluid_event = delete_fluid_event;
+    __fluid_event_set_source = fluid_event_set_source;
+    __fluid_event_set_dest = fluid_event_set_dest;
+    //velocity and preset are shorts in fluidsynth 1.x and ints in 2.x
+    __fluid_event_noteon = [](fluid_event_t* evt, int channel, short key, int vel) {
+        fluid_event_noteon(evt, channel, key, vel);
+    };
+    __fluid_event_noteoff = fluid_event_noteoff;
+    __fluid_event_program_change = [](fluid_event_t* evt, int channel, int preset) {
+        fluid_event_program_change(evt, channel, preset);
+    };
+    __fluid_sequencer_register_client = fluid_sequencer_register_client;
+    __fluid_event_timer = fluid_event_timer;
+    __fluid_event_get_type = fluid_event_get_type;
+    __fluid_event_get_time = fluid_event_get_time;
 #endif
 }
 
 Synth::~Synth()
 {
-    if (fluidloaded) {
+    //load() may have thrown before there was a synth or a soundfont
+    if (fluidloaded && synth && sf_handle != FLUID_FAILED) {
         __fluid_synth_sfunload(synth.get(), sf_handle, 0);
     }
 #ifdef _MSC_VER
@@ -134,6 +293,27 @@ void Synth::load(std::string driver, std::string sf_file)
             this->sf_file = std::string("none");
             throw FluidDriverFail();
         }
+        if (sequencerloaded) {
+            //driven by the synth's own sample clock rather than a system timer,
+            //so events land where they should in the rendered audio
+            sequencer.reset(__new_fluid_sequencer2(0), __delete_fluid_sequencer);
+        }
+        if (sequencer) {
+            seq_id = __fluid_sequencer_register_fluidsynth(sequencer.get(), synth.get());
+            __fluid_sequencer_set_time_scale(sequencer.get(), SEQUENCER_TIME_SCALE);
+            //older fluidsynths clamp the scale, so go by what it ended up as
+            time_scale = __fluid_sequencer_get_time_scale(sequencer.get());
+            event.reset(__new_fluid_event(), __delete_fluid_event);
+            __fluid_event_set_source(event.get(), -1);
+            __fluid_event_set_dest(event.get(), seq_id);
+            if (__fluid_sequencer_register_client) {
+                probe_id = __fluid_sequencer_register_client(sequencer.get(), "onset probe", cbProbe, this);
+                probe_event.reset(__new_fluid_event(), __delete_fluid_event);
+                __fluid_event_set_source(probe_event.get(), -1);
+                __fluid_event_set_dest(probe_event.get(), probe_id);
+                __fluid_event_timer(probe_event.get(), nullptr);
+            }
+        }
         sf_handle = __fluid_synth_sfload(synth.get(), sf_file.c_str(), 1);
         if (sf_handle == FLUID_FAILED) {
             this->sf_file = std::string("none");
@@ -146,12 +326,61 @@ void Synth::load(std::string driver, std::string sf_file)
     }
 }
 
+void Synth::loadOffline(std::string sf_file, double sample_rate, double voice_share)
+{
+    if (fluidloaded) {
+        settings.reset(__new_fluid_settings(), __delete_fluid_settings);
+        __fluid_settings_setnum(settings.get(), "synth.sample-rate", sample_rate);
+        if (voice_share < 1.0 && __fluid_settings_getint && __fluid_settings_setint) {
+            //fresh settings hold the default the live synth plays with
+            int polyphony = 0;
+            __fluid_settings_getint(settings.get(), "synth.polyphony", &polyphony);
+            if (polyphony > 0) {
+                polyphony = std::max(1, static_cast<int>(polyphony * voice_share + 0.5));
+                __fluid_settings_setint(settings.get(), "synth.polyphony", polyphony);
+            }
+        }
+        synth.reset(__new_fluid_synth(settings.get()), __delete_fluid_synth);
+        if (!synth) {
+            this->sf_file = std::string("none");
+            throw FluidInitFail();
+        }
+        sf_handle = __fluid_synth_sfload(synth.get(), sf_file.c_str(), 1);
+        if (sf_handle == FLUID_FAILED) {
+            this->sf_file = std::string("none");
+            throw FluidSFFail();
+        }
+
+        this->sf_file = sf_file;
+        this->driver = std::string("none");
+        is_initialized = true;
+    }
+}
+
+void Synth::write(float* buffer, int frames)
+{
+    if (fluidloaded) {
+        __fluid_synth_write_float(synth.get(), frames, buffer, 0, 2, buffer, 1, 2);
+    } else {
+        std::fill(buffer, buffer + 2 * frames, 0.0f);
+    }
+}
+
 void Synth::reload(std::string driver, std::string sf_file)
 {
     if (fluidloaded) {
         adriver.reset();
+        event.reset();
+        probe_event.reset();
+        sequencer.reset();
+        probe_id = -1;
+        clock_started = false;
         synth.reset();
         settings.reset();
+        sf_handle = FLUID_FAILED;
+        for (auto &notes : active_notes) {
+            notes.reset();
+        }
         load(driver, sf_file);
     }
 }
@@ -170,6 +399,7 @@ void Synth::noteOn(short channel, short value, int velocity)
 {
     if (fluidloaded) {
         __fluid_synth_noteon(synth.get(), channel, value, velocity);
+        active_notes[channel][value] = velocity > 0;
     }
 }
 
@@ -177,6 +407,7 @@ void Synth::noteOff(short channel, short value)
 {
     if (fluidloaded) {
         __fluid_synth_noteoff(synth.get(), channel, value);
+        active_notes[channel][value] = false;
     }
 }
 
@@ -189,11 +420,191 @@ void Synth::programChange(short channel, short voice)
 
 void Synth::clear()
 {
-    if (fluidloaded) {
-        for (int i = 0; i <= 127; i++) {
-            for (int j = 0; j < 16; j++) {
-                __fluid_synth_noteoff(synth.get(), j, i);
+    if (!fluidloaded) {
+        return;
+    }
+    //each call takes the synth's lock, so only touch what may be sounding
+    for (int c = 0; c < 16; c++) {
+        size_t count = active_notes[c].count();
+        if (count == 0) {
+            continue;
+        }
+        if (count > ALL_NOTES_OFF_AT && __fluid_synth_all_notes_off) {
+            __fluid_synth_all_notes_off(synth.get(), c);
+        } else {
+            for (int i = 0; i < 128; i++) {
+                if (active_notes[c][i]) {
+                    __fluid_synth_noteoff(synth.get(), c, i);
+                }
             }
         }
+        active_notes[c].reset();
+    }
+}
+
+bool Synth::canSchedule() const
+{
+    return sequencer != nullptr;
+}
+
+void Synth::startSchedule(uint64_t time)
+{
+    if (sequencer) {
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(clock_mutex);
+        //the clocks are tied together once and kept in step by syncClock(),
+        //tying them again on every seek would throw away the correction
+        if (!clock_started) {
+            clock_tick = __fluid_sequencer_get_tick(sequencer.get());
+            clock_wall = now;
+            last_sync = now;
+            clock_correction = 0.0;
+            window_readings = 0;
+            clock_started = true;
+        }
+        origin_time = time;
+        origin_wall = now;
+    }
+}
+
+void Synth::noteOnAt(uint64_t time, short channel, short value, int velocity)
+{
+    if (!sequencer) {
+        noteOn(channel, value, velocity);
+        return;
+    }
+    __fluid_event_noteon(event.get(), channel, value, velocity);
+    unsigned int tick = schedule(time);
+    if (probe_event && notes_scheduled++ % PROBE_EVERY == 0) {
+        __fluid_sequencer_send_at(sequencer.get(), probe_event.get(), tick, 1);
+    }
+    //counted as sounding from now, it's not known when the sequencer plays it
+    active_notes[channel][value] = true;
+}
+
+void Synth::noteOffAt(uint64_t time, short channel, short value)
+{
+    if (!sequencer) {
+        noteOff(channel, value);
+        return;
+    }
+    __fluid_event_noteoff(event.get(), channel, value);
+    //left marked as sounding, the note off may still be cancelled
+    schedule(time);
+}
+
+void Synth::programChangeAt(uint64_t time, short channel, short voice)
+{
+    if (!sequencer) {
+        programChange(channel, voice);
+        return;
+    }
+    __fluid_event_program_change(event.get(), channel, voice);
+    schedule(time);
+}
+
+void Synth::cancelScheduled()
+{
+    if (sequencer) {
+        __fluid_sequencer_remove_events(sequencer.get(), -1, seq_id, -1);
+    }
+}
+
+unsigned long Synth::lateEvents() const
+{
+    return late_events;
+}
+
+std::string Synth::timingReport()
+{
+    std::ostringstream report;
+    if (!sequencer) {
+        report << "scheduling: off, events are played as they come";
+        return report.str();
+    }
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    report << "scheduling: sequencer resolution " << 1000000.0 / time_scale << "us, "
+           << late_events << " events scheduled late, clock correction "
+           << clock_correction * 1000000.0 / time_scale << "us";
+    if (syncs > 0) {
+        double mean = sync_error_sum / syncs;
+        double variance = std::max(0.0, sync_error_sq_sum / syncs - mean * mean);
+        report << "\nsynth clock off from the system's by " << mean << "us on average ("
+               << std::sqrt(variance) << "us std dev) over " << syncs << " readings";
+    }
+    if (probes > 0) {
+        report << "\n" << probes << " note ons sampled: dispatched by the sequencer "
+               << probe_late_sum / probes << "us after their tick on average (max "
+               << probe_late_max << "us)";
+    }
+    return report.str();
+}
+
+void Synth::cbProbe(unsigned int time, fluid_event_t* event, fluid_sequencer_t* /*seq*/, void* data)
+{
+    //also called when the client is unregistered
+    if (__fluid_event_get_type(event) != FLUID_SEQ_TIMER) {
+        return;
+    }
+    Synth* synth = static_cast<Synth*>(data);
+    //runs on the audio thread, skip the sample rather than wait
+    std::unique_lock<std::mutex> lock(synth->clock_mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        return;
+    }
+    //time is when the sequencer dispatched the probe, at the start of the
+    //block the note on went out in; when it's heard also depends on the
+    //audio driver's buffering, which isn't measured here
+    unsigned int tick = __fluid_event_get_time(event);
+    double late = static_cast<int>(time - tick) * 1000000.0 / synth->time_scale;
+    synth->probes++;
+    synth->probe_late_sum += late;
+    synth->probe_late_max = std::max(synth->probe_late_max, late);
+}
+
+void Synth::syncClock(std::chrono::steady_clock::time_point now, unsigned int tick)
+{
+    //the synth's clock runs off the sound card, which drifts from the system
+    //clock playback is timed with. it only moves when the driver renders a
+    //buffer, so readings fall behind by up to a buffer in between; going by
+    //the greatest error seen in an interval keeps events from being sent for
+    //ticks the synth has already rendered
+    double error = static_cast<int>(tick - expectedTick(now));
+    if (window_readings == 0 || error > window_error) {
+        window_error = error;
+    }
+    window_readings++;
+    if (now - last_sync < std::chrono::microseconds(CLOCK_SYNC_INTERVAL)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(clock_mutex);
+    clock_correction += window_error / CLOCK_SYNC_SMOOTHING;
+    last_sync = now;
+    double error_us = window_error * 1000000.0 / time_scale;
+    window_readings = 0;
+    syncs++;
+    sync_error_sum += error_us;
+    sync_error_sq_sum += error_us * error_us;
+}
+
+unsigned int Synth::expectedTick(std::chrono::steady_clock::time_point wall) const
+{
+    double elapsed = std::chrono::duration<double, std::micro>(wall - clock_wall).count();
+    return clock_tick + static_cast<int64_t>(elapsed * time_scale / 1000000.0 + clock_correction);
+}
+
+unsigned int Synth::schedule(uint64_t time)
+{
+    auto now = std::chrono::steady_clock::now();
+    unsigned int current = __fluid_sequencer_get_tick(sequencer.get());
+    syncClock(now, current);
+    auto wall = origin_wall + std::chrono::microseconds(static_cast<int64_t>(time - origin_time));
+    unsigned int tick = expectedTick(wall);
+    //the tick counter wraps around, so compare the difference
+    if (static_cast<int>(tick - current) < 0) {
+        late_events++;
+        tick = current;
     }
+    __fluid_sequencer_send_at(sequencer.get(), event.get(), tick, 1);
+    return tick;
 }
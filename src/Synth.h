@@ -19,9 +19,21 @@
 #include <string>
 #include <exception>
 #include <memory>
+#include <cstdint>
+#include <bitset>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 
 #include <fluidsynth.h>
 
+#ifndef DEFAULT_SF2
+#define DEFAULT_SF2 "soundfonts/GeneralUser_GS_v1.47.sf2"
+#endif
+#ifndef DEFAULT_DRIVER
+#define DEFAULT_DRIVER "dsound"
+#endif
+
 class Synth {
 public:
     Synth();
@@ -32,13 +44,42 @@ public:
     //calling load more than once has undefined results, use reload()
     void load(std::string driver, std::string sf_file);
     void reload(std::string driver, std::string sf_file);
+    //loads the synth without an audio driver or sequencer, its output is
+    //only what's pulled out with write(), events play straight away. It gets
+    //voice_share of the usual polyphony, so synths splitting a song between
+    //them run out of voices about when a single one would
+    void loadOffline(std::string sf_file, double sample_rate, double voice_share = 1.0);
+    //synthesizes the next frames of interleaved float stereo into buffer
+    void write(float* buffer, int frames);
     std::string getDriver();
     std::string getSF();
     void noteOn(short channel, short value, int velocity);
     void noteOff(short channel, short value);
     void programChange(short channel, short voice);
+    //releases every note that may be sounding
     void clear();
 
+    //whether events can be handed to fluidsynth ahead of time with the
+    //calls below, if not they're played straight away
+    bool canSchedule() const;
+    //ties playback time (in us) to now on the system clock, scheduled events
+    //are played relative to it; the synth's clock is corrected to follow the
+    //system's as events are scheduled
+    void startSchedule(uint64_t time);
+    //play the event when the synth reaches time, or straight away if it
+    //already has; those count as late
+    void noteOnAt(uint64_t time, short channel, short value, int velocity);
+    void noteOffAt(uint64_t time, short channel, short value);
+    void programChangeAt(uint64_t time, short channel, short voice);
+    //drops scheduled events that haven't been played yet
+    void cancelScheduled();
+    //number of events scheduled after their time had already passed
+    unsigned long lateEvents() const;
+    //how late the sequencer dispatched scheduled note ons, measured on a
+    //sample of them, and how well the synth's clock is kept in step with the
+    //system's. Output latency after dispatch isn't included
+    std::string timingReport();
+
     class FluidInitFail : public std::exception {
     public:
         virtual const char* what() const noexcept
@@ -64,12 +105,60 @@ public:
     };
 
 private:
+    //sends event to the sequencer for time, returns the tick it was sent for
+    unsigned int schedule(uint64_t time);
+    //takes a reading of the synth's clock, tick at the system time now, and
+    //moves the correction towards it every CLOCK_SYNC_INTERVAL
+    void syncClock(std::chrono::steady_clock::time_point now, unsigned int tick);
+    //the synth's tick at the given system time
+    unsigned int expectedTick(std::chrono::steady_clock::time_point wall) const;
+    //records when a probe scheduled after a note on was dispatched, data is the Synth
+    static void cbProbe(unsigned int time, fluid_event_t* event, fluid_sequencer_t* seq, void* data);
+
     bool is_initialized;
     std::string driver;
     std::string sf_file;
     std::shared_ptr<fluid_settings_t> settings;
     std::shared_ptr<fluid_synth_t> synth;
+    //the audio thread reads these from cbProbe() while the sequencer may be
+    //playing, so they're declared ahead of it to outlive it
+    std::mutex clock_mutex;
+    //sequencer tick at the system time clock_wall, plus a correction in ticks
+    //for how far the synth's clock has drifted since
+    unsigned int clock_tick;
+    std::chrono::steady_clock::time_point clock_wall;
+    std::chrono::steady_clock::time_point last_sync;
+    bool clock_started;
+    double clock_correction;
+    //greatest error in ticks read since the correction was last updated
+    double window_error;
+    unsigned long window_readings;
+    //corrections made by syncClock() and the error they were made for, in us
+    unsigned long syncs;
+    double sync_error_sum;
+    double sync_error_sq_sum;
+    //note ons measured by cbProbe() and how late they were dispatched, in us
+    unsigned long probes;
+    double probe_late_sum;
+    double probe_late_max;
+    //between synth and adriver so it's destroyed after the driver stops
+    //and before the synth goes
+    std::shared_ptr<fluid_sequencer_t> sequencer;
+    std::shared_ptr<fluid_event_t> event;
+    std::shared_ptr<fluid_event_t> probe_event;
     std::shared_ptr<fluid_audio_driver_t> adriver;
+    fluid_seq_id_t seq_id;
+    fluid_seq_id_t probe_id;
+    //system time at playback time origin_time
+    std::chrono::steady_clock::time_point origin_wall;
+    uint64_t origin_time;
+    double time_scale;
+    std::atomic<unsigned long> late_events;
+    unsigned long notes_scheduled;
+    //notes per channel that may be sounding, played or scheduled since
+    //they were last turned off
+    std::bitset<128> active_notes[16];
+    //FLUID_FAILED until a soundfont is loaded
     int sf_handle;
 };
 
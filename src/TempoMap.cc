@@ -0,0 +1,109 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include "TempoMap.h"
+
+#define DEFAULT_TEMPO 500000 //us per quarter note, 120 bpm
+
+TempoMap::TempoMap(uint16_t division) : division(division), smpte_ticks_per_second(0)
+{
+    //the division is -frames per second and ticks per frame when the top bit is set
+    if (division & 0x8000) {
+        smpte_ticks_per_second = static_cast<uint64_t>(-static_cast<int8_t>(division >> 8))
+                                 * (division & 0xFF);
+    }
+    setTempoChanges(std::vector<TempoChange>());
+}
+
+void TempoMap::setTempoChanges(std::vector<TempoChange> changes)
+{
+    std::stable_sort(changes.begin(), changes.end(),
+                     [](const TempoChange& a, const TempoChange& b) { return a.tick < b.tick; });
+
+    segments.clear();
+    Segment first = { 0, 0, DEFAULT_TEMPO };
+    segments.push_back(first);
+    for (auto &change : changes) {
+        Segment& last = segments.back();
+        if (change.tick == last.tick) {
+            last.tempo = change.tempo;
+        } else {
+            Segment seg = { change.tick, segmentMicros(last, change.tick), change.tempo };
+            segments.push_back(seg);
+        }
+    }
+}
+
+std::vector<TempoMap::TempoChange> TempoMap::getTempoChanges() const
+{
+    std::vector<TempoChange> changes;
+    for (auto &seg : segments) {
+        TempoChange change = { seg.tick, seg.tempo };
+        changes.push_back(change);
+    }
+    return changes;
+}
+
+uint16_t TempoMap::getDivision() const
+{
+    return division;
+}
+
+uint64_t TempoMap::tickToMicros(uint64_t tick) const
+{
+    //last segment starting at or before tick
+    auto it = std::upper_bound(segments.begin(), segments.end(), tick,
+                               [](uint64_t t, const Segment& seg) { return t < seg.tick; });
+    return segmentMicros(*(it - 1), tick);
+}
+
+uint64_t TempoMap::microsToTick(uint64_t micros) const
+{
+    //tickToMicros() rounds down, so this is the last tick it takes to micros
+    //or before rather than micros scaled back, which would land a tick early
+    if (smpte_ticks_per_second) {
+        return ((micros + 1) * smpte_ticks_per_second - 1) / 1000000;
+    }
+    //last segment starting at or before micros
+    auto it = std::upper_bound(segments.begin(), segments.end(), micros,
+                               [](uint64_t us, const Segment& seg) { return us < seg.micros; });
+    const Segment& seg = *(it - 1);
+    if (seg.tempo == 0) {
+        return seg.tick;
+    }
+    return seg.tick + ((micros - seg.micros + 1) * division - 1) / seg.tempo;
+}
+
+uint64_t TempoMap::segmentMicros(const Segment& seg, uint64_t tick) const
+{
+    if (smpte_ticks_per_second) {
+        return tick * 1000000 / smpte_ticks_per_second;
+    }
+    return seg.micros + (tick - seg.tick) * seg.tempo / division;
+}
+
+uint64_t TempoMap::Cursor::tickToMicros(uint64_t tick)
+{
+    const std::vector<Segment>& segs = map.segments;
+    if (tick < segs[segment].tick) {
+        segment = 0;
+    }
+    while (segment + 1 < segs.size() && segs[segment + 1].tick <= tick) {
+        segment++;
+    }
+    return map.segmentMicros(segs[segment], tick);
+}
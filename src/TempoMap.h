@@ -0,0 +1,70 @@
+#ifndef TEMPOMAP_H
+#define TEMPOMAP_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <vector>
+#include <cstdint>
+
+//converts MIDI ticks to microseconds for a whole file, from the tempo
+//changes of all of its tracks
+class TempoMap {
+public:
+    struct TempoChange {
+        uint64_t tick;
+        uint32_t tempo; //us per quarter note
+    };
+
+    //division is taken straight from the file header
+    TempoMap(uint16_t division = 480);
+
+    //replaces the tempo changes; changes at the same tick resolve to the
+    //last one given, so pass them in track order
+    void setTempoChanges(std::vector<TempoChange> changes);
+    std::vector<TempoChange> getTempoChanges() const;
+    uint16_t getDivision() const;
+    uint64_t tickToMicros(uint64_t tick) const;
+    //nearest tick at or before this time
+    uint64_t microsToTick(uint64_t micros) const;
+
+    //converts a non-decreasing sequence of ticks without searching each time
+    class Cursor {
+    public:
+        Cursor(const TempoMap& map) : map(map), segment(0) {}
+        uint64_t tickToMicros(uint64_t tick);
+
+    private:
+        const TempoMap& map;
+        size_t segment;
+    };
+
+private:
+    //a run of ticks at a constant tempo, starting at tick/micros
+    struct Segment {
+        uint64_t tick;
+        uint64_t micros;
+        uint32_t tempo;
+    };
+
+    uint64_t segmentMicros(const Segment& seg, uint64_t tick) const;
+
+    std::vector<Segment> segments;
+    uint16_t division;
+    //for SMPTE divisions tempo doesn't matter, ticks are a fixed length
+    uint64_t smpte_ticks_per_second;
+};
+
+#endif /* TEMPOMAP_H */
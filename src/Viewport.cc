@@ -17,89 +17,92 @@
 #include <cmath>
 #include <cstdio>
 #include <memory>
-#include <chrono>
 #include <Fl/fl_draw.H>
 #include <Fl/fl_ask.H>
 #include <Fl/Fl_Preferences.H>
 #include "Viewport.h"
 
+//seconds between frames while playing
+#define FRAME_INTERVAL (1.0 / 60.0)
+//damage() bits for redrawEditor(), redrawKeys() and scrollEditor()
+#define DAMAGE_EDITOR FL_DAMAGE_USER1
+#define DAMAGE_KEYS FL_DAMAGE_USER2
+#define DAMAGE_SCROLL FL_DAMAGE_SCROLL
+
 Keyboard::Keyboard(int x, int y, int w, int h, Viewport* view) : x(x), y(y), w(w), h(h), view(view)
 {
-    key_width = w / 52; //key_width is the width of a white key
-    n = std::ceil(2.0f / (static_cast<float>(w) / 52.0f - key_width));
     key_states.fill(false);
+    key_colours.fill(0);
+    dirty_keys.fill(false);
+    layout();
 }
 
 void Keyboard::setKey(short key, bool value, int r, int g, int b)
 {
     //keyboard contains midi values 21 through 108
     if (key >= 21 && key <= 108){
-        key_states[key - 21] = value;
-        int idx = (key - 21) * 3;
+        int i = key - 21;
+        int idx = i * 3;
+        if (key_states[i] == value && key_colours[idx] == r && key_colours[idx + 1] == g
+            && key_colours[idx + 2] == b){
+            return;
+        }
+        key_states[i] = value;
         key_colours[idx] = r;
         key_colours[idx + 1] = g;
         key_colours[idx + 2] = b;
+        keyChanged(i);
     }
 }
 
 void Keyboard::clear()
 {
-    key_states.fill(false);
+    for (int i = 0; i < 88; i++){
+        if (key_states[i]){
+            key_states[i] = false;
+            keyChanged(i);
+        }
+    }
 }
 
-void Keyboard::draw() const
+void Keyboard::draw()
 {
-    int key_width = this->key_width;
-    int offset = 0; //only increments after each white note, black keys drawn
-                    //relative to previous white note.
-    int whites = 0; //counts white keys for making nth white key wider
-    int black_width = (2 * key_width) / 3;
-    int black_height = (2 * h) / 3;
-    Fl_Color colour;
-
     fl_rectf(x, y, w, h, 100, 100, 100);
+    //black keys go on top of the white ones
     for (int i = 0; i < 88; i++){
-        if (key_states[i])
-            colour = fl_rgb_color(key_colours[i*3], key_colours[i*3+1], key_colours[i*3+2]);
-        else
-            colour = fl_rgb_color(255, 255, 255);
-        if (i % 12 != 1 && i % 12 != 6 && i % 12 != 11 && i % 12 != 4
-            && i % 12 != 9){ //white notes
-            key_width = this->key_width;
-            if (whites % n == 0)
-                key_width += 2;
-            fl_rectf(x + offset + 1, y, key_width - 2, h, colour);
-            offset += key_width;
-            whites++;
+        if (!isBlackKey(i)){
+            drawKey(i);
         }
     }
+    for (int i = 0; i < 88; i++){
+        if (isBlackKey(i)){
+            drawKey(i);
+        }
+    }
+    dirty_keys.fill(false);
+}
 
-    offset = 0;
-    whites = 0;
+void Keyboard::drawChanged()
+{
     for (int i = 0; i < 88; i++){
-        key_width = this->key_width;
-        colour = fl_rgb_color(key_colours[i*3], key_colours[i*3+1], key_colours[i*3+2]);
-        if (i % 12 == 1 || i % 12 == 6 || i % 12 == 11){ //Bb, Eb, Ab
-            fl_rectf(x + offset - key_width / 3, y, black_width, black_height,
-                     0, 0, 0);
-            if (!key_states[i])
-                colour = fl_rgb_color(0, 0, 0);
-            fl_rectf(2 + x + offset - key_width / 3, 2 + y, black_width - 4, black_height - 4,
-                     colour);
-        } else if (i % 12 == 4 || i % 12 == 9){ //Db and Gb
-            fl_rectf(x + offset - key_width * 3 / 8, y, black_width, black_height,
-                     0, 0, 0);
-            if (!key_states[i])
-                colour = fl_rgb_color(0, 0, 0);
-            fl_rectf(2 + x + offset - key_width * 3 / 8, y, black_width - 4, black_height - 4,
-                     colour);
-        } else {
-            if (whites % n == 0)
-                key_width += 2;
-            offset += key_width;
-            whites++;
+        if (!dirty_keys[i] || isBlackKey(i)){
+            continue;
+        }
+        drawKey(i);
+        //drawing a white key covers part of the black keys either side
+        if (i > 0 && isBlackKey(i - 1)){
+            dirty_keys[i - 1] = true;
+        }
+        if (i < 87 && isBlackKey(i + 1)){
+            dirty_keys[i + 1] = true;
         }
     }
+    for (int i = 0; i < 88; i++){
+        if (dirty_keys[i] && isBlackKey(i)){
+            drawKey(i);
+        }
+    }
+    dirty_keys.fill(false);
 }
 
 void Keyboard::move(int x, int y)
@@ -112,14 +115,74 @@ void Keyboard::resize(int w, int h)
 {
     this->w = w;
     this->h = h;
-    key_width = w / 52;
+    layout();
+}
+
+void Keyboard::layout()
+{
+    key_width = w / 52; //key_width is the width of a white key
     n = std::ceil(2.0f / (static_cast<float>(w) / 52.0f - key_width));
+    int offset = 0; //only increments after each white note, black keys drawn
+                    //relative to previous white note.
+    int whites = 0; //counts white keys for making nth white key wider
+    int black_width = (2 * key_width) / 3;
+
+    for (int i = 0; i < 88; i++){
+        if (i % 12 == 1 || i % 12 == 6 || i % 12 == 11){ //Bb, Eb, Ab
+            key_left[i] = offset - key_width / 3;
+            key_widths[i] = black_width;
+        } else if (i % 12 == 4 || i % 12 == 9){ //Db and Gb
+            key_left[i] = offset - key_width * 3 / 8;
+            key_widths[i] = black_width;
+        } else {
+            key_left[i] = offset;
+            key_widths[i] = key_width;
+            if (whites % n == 0)
+                key_widths[i] += 2;
+            offset += key_widths[i];
+            whites++;
+        }
+    }
+}
+
+bool Keyboard::isBlackKey(int i)
+{
+    //i counts from A0
+    return i % 12 == 1 || i % 12 == 4 || i % 12 == 6 || i % 12 == 9 || i % 12 == 11;
+}
+
+void Keyboard::drawKey(int i) const
+{
+    int black_height = (2 * h) / 3;
+    Fl_Color colour = fl_rgb_color(key_colours[i*3], key_colours[i*3+1], key_colours[i*3+2]);
+    int left = x + key_left[i];
+
+    if (!isBlackKey(i)){
+        if (!key_states[i])
+            colour = fl_rgb_color(255, 255, 255);
+        fl_rectf(left + 1, y, key_widths[i] - 2, h, colour);
+        return;
+    }
+    fl_rectf(left, y, key_widths[i], black_height, 0, 0, 0);
+    if (!key_states[i])
+        colour = fl_rgb_color(0, 0, 0);
+    if (i % 12 == 4 || i % 12 == 9){ //Db and Gb
+        fl_rectf(2 + left, y, key_widths[i] - 4, black_height - 4, colour);
+    } else {
+        fl_rectf(2 + left, 2 + y, key_widths[i] - 4, black_height - 4, colour);
+    }
+}
+
+void Keyboard::keyChanged(int i)
+{
+    dirty_keys[i] = true;
+    view->redrawKeys();
 }
 
 Viewport::Viewport(int x, int y, int w, int h)
                    : Fl_Box(FL_EMBOSSED_FRAME, x, y, w, h, ""),
                      keyboard(x, y + 3 * h / 4, w, h / 4, this), editor(x, y, w, 3 * h / 4, this),
-                     data(this), play(this)
+                     play(this), time_cb(nullptr), time_cb_data(nullptr)
 {
     std::shared_ptr<Fl_Preferences> prefs(new Fl_Preferences(Fl_Preferences::USER,
                                                              "MiniMIDI", "MiniMIDI"));
@@ -127,12 +190,11 @@ Viewport::Viewport(int x, int y, int w, int h)
 
     prefs->get("soundfont", sf2, DEFAULT_SF2);
     try {
-        play.getSynth()->load(DEFAULT_DRIVER, std::string(sf2));
+        play.loadSynth(DEFAULT_DRIVER, std::string(sf2));
     } catch (std::exception &e){
         fl_alert(e.what());
     }
     data.newTrack();
-    Fl::add_timeout(0.001, Viewport::cbEveryFrame, this);
 }
 
 Keyboard* Viewport::getKeyboard()
@@ -150,6 +212,19 @@ Playback* Viewport::getPlayback()
     return &play;
 }
 
+void Viewport::setTimeCallback(void (*cb)(void*), void* data)
+{
+    time_cb = cb;
+    time_cb_data = data;
+}
+
+void Viewport::timeChanged()
+{
+    if (time_cb){
+        time_cb(time_cb_data);
+    }
+}
+
 MIDIData* Viewport::getMIDIData()
 {
     return &data;
@@ -157,8 +232,20 @@ MIDIData* Viewport::getMIDIData()
 
 void Viewport::draw()
 {
-    editor.draw();
-    keyboard.draw();
+    if (damage() & ~(DAMAGE_EDITOR | DAMAGE_KEYS | DAMAGE_SCROLL)){
+        editor.draw();
+        keyboard.draw();
+    } else {
+        if (damage() & DAMAGE_EDITOR){
+            editor.draw();
+        } else if (damage() & DAMAGE_SCROLL){
+            editor.draw(true);
+        }
+        if (damage() & DAMAGE_KEYS){
+            keyboard.drawChanged();
+        }
+    }
+    //the frame overlaps the edges of both
     Fl_Box::draw();
 }
 
@@ -175,8 +262,9 @@ int Viewport::handle(int event)
 {
     int mouse_x = Fl::event_x();
     int mouse_y = Fl::event_y();
+    //no editing while a file is still loading
     if (mouse_x > x() && mouse_x < x() + w() &&
-            mouse_y > y() && mouse_y < y() + h()){
+            mouse_y > y() && mouse_y < y() + h() && !data.isLoading()){
         if (event == Fl_Event::FL_PUSH && Fl::event_button() == FL_LEFT_MOUSE){
             editor.mouseDown(mouse_x, mouse_y);
             return 1;
@@ -189,22 +277,49 @@ int Viewport::handle(int event)
         } else if (event == Fl_Event::FL_RELEASE && Fl::event_button() == FL_RIGHT_MOUSE){
             editor.rightRelease(mouse_x, mouse_y);
             return 1;
+        } else if (event == Fl_Event::FL_MOUSEWHEEL && Fl::event_state(FL_CTRL)){
+            //ctrl+wheel zooms time in and out
+            if (Fl::event_dy() > 0){
+                editor.setMsPerPixel(editor.getMsPerPixel() * 2);
+            } else if (Fl::event_dy() < 0){
+                editor.setMsPerPixel(editor.getMsPerPixel() / 2);
+            }
+            return 1;
         }
     }
     return Fl_Box::handle(event);
 }
 
+void Viewport::redrawEditor()
+{
+    damage(DAMAGE_EDITOR);
+}
+
+void Viewport::redrawKeys()
+{
+    damage(DAMAGE_KEYS);
+}
+
+void Viewport::scrollEditor()
+{
+    damage(DAMAGE_SCROLL);
+}
+
+void Viewport::startFrames()
+{
+    if (!Fl::has_timeout(Viewport::cbEveryFrame, this)){
+        Fl::add_timeout(FRAME_INTERVAL, Viewport::cbEveryFrame, this);
+    }
+}
+
 void Viewport::cbEveryFrame(void* v)
 {
-    static std::chrono::time_point<std::chrono::steady_clock> last;
-    if (std::chrono::duration_cast<std::chrono::milliseconds>
-          (std::chrono::steady_clock::now() - last).count() >= 16){
-        Viewport* view = static_cast<Viewport*>(v);
-        view->getPlayback()->everyFrame();
-        if (view->getPlayback()->isPlaying()){
-            view->redraw();
-        }
-        last = std::chrono::steady_clock::now();
+    Viewport* view = static_cast<Viewport*>(v);
+    view->getPlayback()->everyFrame();
+    //nothing moves while paused, and whatever stops or seeks playback
+    //redraws what it changed itself
+    if (view->getPlayback()->isPlaying()){
+        view->scrollEditor();
+        Fl::repeat_timeout(FRAME_INTERVAL, Viewport::cbEveryFrame, v);
     }
-    Fl::repeat_timeout(0.001, Viewport::cbEveryFrame, v);
 }
@@ -16,17 +16,11 @@
  *  You should have received a copy of the GNU General Public License
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#ifndef DEFAULT_SF2
-#define DEFAULT_SF2 "soundfonts/GeneralUser_GS_v1.47.sf2"
-#endif
-#ifndef DEFAULT_DRIVER
-#define DEFAULT_DRIVER "dsound"
-#endif
-
 #include <array>
 #include <Fl/Fl.H>
 #include <Fl/Fl_Box.H>
 #include "MIDI.h"
+#include "Playback.h"
 #include "NoteEditor.h"
 
 
@@ -37,14 +31,28 @@ public:
     void setKey(short key, bool value, int r, int g, int b);
     //releases all keys
     void clear();
-    void draw() const;
+    void draw();
+    //draws only the keys that changed since the last draw
+    void drawChanged();
     void move(int x, int y);
     void resize(int w, int h);
 
 private:
+    //works out where each key goes for the current width
+    void layout();
+    static bool isBlackKey(int i);
+    void drawKey(int i) const;
+    //marks key i to be drawn and asks the Viewport for a keyboard redraw
+    void keyChanged(int i);
+
     Viewport* view;
     std::array<bool, 88> key_states;
     std::array<int, 264> key_colours; //stored as { r, g, b, r, g, b, ...}
+    //keys changed since the last draw
+    std::array<bool, 88> dirty_keys;
+    //left edge of each key relative to x, and its width
+    std::array<int, 88> key_left;
+    std::array<int, 88> key_widths;
     int x, y, w, h;
     int key_width;
     int n; //due to truncation of key_width, there is a gap at the right of keyboard,
@@ -60,9 +68,22 @@ public:
     NoteEditor* getEditor();
     Playback* getPlayback();
     MIDIData* getMIDIData();
+    //draws everything on FL_DAMAGE_ALL, otherwise just what was asked for
+    //with redrawEditor(), scrollEditor() and redrawKeys()
     virtual void draw();
     virtual void resize(int x, int y, int w, int h);
+    //redraw only the note editor, or only the keys set since the last draw
+    void redrawEditor();
+    void redrawKeys();
+    //redraw the note editor after only the playback time has changed
+    void scrollEditor();
     virtual int handle(int event);
+    //redraws every frame until playback stops
+    void startFrames();
+    //cb(data) is called whenever playback jumps to another time
+    void setTimeCallback(void (*cb)(void*), void* data);
+    //called by Playback after a seek, from the UI thread
+    void timeChanged();
 
     static void cbEveryFrame(void* v);
 
@@ -71,6 +92,8 @@ private:
     NoteEditor editor;
     MIDIData data;
     Playback play;
+    void (*time_cb)(void*);
+    void* time_cb_data;
 };
 
 #endif /* VIEWPORT_H */
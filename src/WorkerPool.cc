@@ -0,0 +1,161 @@
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include "WorkerPool.h"
+
+WorkerPool::WorkerPool(unsigned num_threads) : pending(0), stopping(false)
+{
+    if (num_threads == 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < num_threads; i++) {
+        queues.emplace_back(new Queue);
+    }
+    for (unsigned i = 0; i < num_threads; i++) {
+        threads.emplace_back(&WorkerPool::workerLoop, this, i);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lk(wake_mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &t : threads) {
+        t.join();
+    }
+}
+
+unsigned WorkerPool::numThreads() const
+{
+    return threads.size();
+}
+
+std::vector<std::exception_ptr> WorkerPool::run(std::vector<Task> tasks,
+                                                const std::vector<size_t>& costs)
+{
+    int num_tasks = tasks.size();
+    Batch batch;
+    batch.errors.resize(num_tasks);
+    batch.remaining = num_tasks;
+    if (num_tasks == 0) {
+        return batch.errors;
+    }
+
+    //deal the tasks out biggest first, so every queue starts on its largest task
+    std::vector<int> order(num_tasks);
+    for (int i = 0; i < num_tasks; i++) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](int a, int b) { return costs[a] > costs[b]; });
+    for (int i = 0; i < num_tasks; i++) {
+        Queue& q = *queues[i % queues.size()];
+        Job job = { std::move(tasks[order[i]]), &batch, order[i] };
+        std::lock_guard<std::mutex> lk(q.mutex);
+        q.jobs.push_back(std::move(job));
+    }
+    {
+        std::lock_guard<std::mutex> lk(wake_mutex);
+        pending += num_tasks;
+    }
+    wake.notify_all();
+
+    //work on the calling thread too, this also keeps nested run() calls
+    //from a task from starving the pool
+    Job job;
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lk(batch.mutex);
+            if (batch.remaining == 0) {
+                break;
+            }
+        }
+        if (takeJob(0, job)) {
+            execute(job);
+        } else {
+            //everything left is already running on a worker
+            std::unique_lock<std::mutex> lk(batch.mutex);
+            batch.done.wait(lk, [&] { return batch.remaining == 0; });
+        }
+    }
+    return batch.errors;
+}
+
+WorkerPool& WorkerPool::shared()
+{
+    static WorkerPool pool;
+    return pool;
+}
+
+void WorkerPool::workerLoop(unsigned id)
+{
+    Job job;
+    for (;;) {
+        if (takeJob(id, job)) {
+            execute(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> lk(wake_mutex);
+        wake.wait(lk, [&] { return stopping || pending > 0; });
+        if (stopping && pending == 0) {
+            return;
+        }
+    }
+}
+
+bool WorkerPool::takeJob(unsigned first, Job& job)
+{
+    unsigned num_queues = queues.size();
+    for (unsigned i = 0; i < num_queues; i++) {
+        Queue& q = *queues[(first + i) % num_queues];
+        std::lock_guard<std::mutex> lk(q.mutex);
+        if (q.jobs.empty()) {
+            continue;
+        }
+        //the owner takes the biggest job, thieves take the smallest
+        if (i == 0) {
+            job = std::move(q.jobs.front());
+            q.jobs.pop_front();
+        } else {
+            job = std::move(q.jobs.back());
+            q.jobs.pop_back();
+        }
+        pending--;
+        return true;
+    }
+    return false;
+}
+
+void WorkerPool::execute(Job& job)
+{
+    Batch* batch = job.batch;
+    try {
+        job.task();
+    } catch (...) {
+        batch->errors[job.index] = std::current_exception();
+    }
+    job.task = nullptr;
+
+    //notify while holding the lock, the batch lives on the stack of run()
+    std::lock_guard<std::mutex> lk(batch->mutex);
+    if (--batch->remaining == 0) {
+        batch->done.notify_all();
+    }
+}
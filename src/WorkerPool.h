@@ -0,0 +1,86 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+/*  MiniMIDI: A simple, lightweight, crossplatform MIDI editor.
+ *  Copyright (C) 2016 Nicholas Parkanyi
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+//fixed set of threads for CPU-bound work. Each worker has its own queue
+//and steals from the others' once it runs dry.
+class WorkerPool {
+public:
+    typedef std::function<void()> Task;
+
+    //0 threads means one per hardware thread
+    WorkerPool(unsigned num_threads = 0);
+    ~WorkerPool();
+
+    unsigned numThreads() const;
+    //runs every task and waits for all of them, helping out on the calling
+    //thread. Tasks with the largest cost are started first so a single big
+    //task doesn't end up running alone at the end. Returns one entry per
+    //task, holding the exception it threw or null if it succeeded.
+    std::vector<std::exception_ptr> run(std::vector<Task> tasks,
+                                        const std::vector<size_t>& costs);
+
+    //pool shared by the whole program, sized to the hardware
+    static WorkerPool& shared();
+
+private:
+    //tasks handed to one run() call
+    struct Batch {
+        std::vector<std::exception_ptr> errors;
+        int remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+
+    struct Job {
+        Task task;
+        Batch* batch;
+        int index;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    WorkerPool(const WorkerPool&);
+    WorkerPool& operator=(const WorkerPool&);
+
+    void workerLoop(unsigned id);
+    //takes from queue first, otherwise steals from the others
+    bool takeJob(unsigned first, Job& job);
+    void execute(Job& job);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<int> pending;
+    bool stopping;
+    std::mutex wake_mutex;
+    std::condition_variable wake;
+};
+
+#endif /* WORKERPOOL_H */
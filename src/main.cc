@@ -15,9 +15,16 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <memory>
+#include <string>
+#include <chrono>
+#include <ctime>
+#include <cstdlib>
+#include <iostream>
 #include <Fl/Fl.H>
 #include <Fl/Fl_Preferences.H>
 #include "MainWindow.h"
+#include "MIDILoader.h"
+#include "Renderer.h"
 
 void loadPrefs()
 {
@@ -37,12 +44,107 @@ void loadPrefs()
 }
 
 
+//seconds to sit idle with --idle-benchmark, 0 runs normally
+static double idle_benchmark = 0;
+//with --onset-report, prints how late the sequencer dispatched notes on exit
+static bool onset_report = false;
+//with --render, the MIDI file to render and the audio file to write it to
+static std::string render_in;
+static std::string render_out;
+
+//handles the options FLTK doesn't, returns how many arguments were used
+static int parseArg(int argc, char** argv, int& i)
+{
+    if (std::string(argv[i]) == "--idle-benchmark" && i + 1 < argc){
+        idle_benchmark = std::atof(argv[i + 1]);
+        i += 2;
+        return 2;
+    }
+    if (std::string(argv[i]) == "--onset-report"){
+        onset_report = true;
+        i += 1;
+        return 1;
+    }
+    if (std::string(argv[i]) == "--render" && i + 2 < argc){
+        render_in = argv[i + 1];
+        render_out = argv[i + 2];
+        i += 3;
+        return 3;
+    }
+    return 0;
+}
+
+//renders a MIDI file with the soundfont from the settings, without opening
+//a window or an audio device
+int renderFile(std::string in, std::string out)
+{
+    std::shared_ptr<Fl_Preferences> prefs(new Fl_Preferences(Fl_Preferences::USER,
+            "MiniMIDI", "MiniMIDI"));
+    char* sf2;
+    prefs->get("soundfont", sf2, DEFAULT_SF2);
+
+    try {
+        MIDIData data;
+        MIDILoader(in, &data).load();
+        Renderer renderer(&data, std::string(sf2));
+        auto start = std::chrono::steady_clock::now();
+        renderer.render(out);
+        double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        double song = renderer.getDuration() / 1000000.0;
+        std::cout << "rendered " << song << "s of " << in << " to " << out << " in " << wall
+                  << "s (" << song / wall << "x real time)" << std::endl;
+    } catch (std::exception &e){
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+//runs the event loop paused for the given time and reports the CPU time
+//used and how often the loop woke up, which should both stay near zero
+int idleBenchmark(double seconds)
+{
+    std::clock_t cpu_start = std::clock();
+    auto start = std::chrono::steady_clock::now();
+    auto end = start + std::chrono::microseconds(static_cast<int64_t>(seconds * 1000000));
+    long wakeups = 0;
+    while (Fl::first_window()){
+        auto now = std::chrono::steady_clock::now();
+        if (now >= end){
+            break;
+        }
+        Fl::wait(std::chrono::duration<double>(end - now).count());
+        wakeups++;
+    }
+    double cpu = static_cast<double>(std::clock() - cpu_start) / CLOCKS_PER_SEC;
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "idle for " << wall << "s: " << cpu << "s CPU (" << 100 * cpu / wall
+              << "%), " << wakeups << " wakeups" << std::endl;
+    return 0;
+}
+
 int main(int argc, char** argv)
 {
+    int i;
+    if (Fl::args(argc, argv, i, parseArg) < argc){
+        Fl::fatal("error: unknown option: %s\nusage: %s [options]\n"
+                  " --idle-benchmark seconds\n --onset-report\n --render file.mid file.wav\n%s",
+                  argv[i], argv[0], Fl::help);
+    }
+    if (!render_in.empty()){
+        return renderFile(render_in, render_out);
+    }
     loadPrefs();
 
     MainWindow* win = new MainWindow();
     win->end();
     win->show(argc, argv);
-    return Fl::run();
+    if (idle_benchmark > 0){
+        return idleBenchmark(idle_benchmark);
+    }
+    int status = Fl::run();
+    if (onset_report){
+        std::cout << win->getViewport()->getPlayback()->getSynth()->timingReport() << std::endl;
+    }
+    return status;
 }